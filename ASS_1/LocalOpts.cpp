@@ -9,20 +9,59 @@
 #include "llvm/Transforms/Utils/LocalOpts.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Parallel.h"
 // L'include seguente va in LocalOpts.h
 #include <llvm/IR/Constants.h>
 #include <cmath>
+#include <mutex>
 
 using namespace llvm;
 
-// svolto a lezione ma migliorato in runOnBasicBlockAdv
+#define DEBUG_TYPE "localopts"
+
+STATISTIC(NumAlgebraicIdentity, "Identità algebriche risolte");
+STATISTIC(NumStrengthReduction, "Moltiplicazioni ridotte a shift/add");
+STATISTIC(NumStrengthReductionMissed, "Moltiplicazioni mantenute perché più economiche della sequenza");
+STATISTIC(NumDivisionLowering, "Divisioni e resti per costante sostituiti");
+STATISTIC(NumDivisionLoweringMissed, "Divisioni e resti per costante mantenuti");
+STATISTIC(NumMultiInstruction, "Anelli di catene di costanti riassociati");
+STATISTIC(NumMultiInstructionMissed, "Catene di costanti non riassociabili");
+STATISTIC(NumDeadErased, "Istruzioni morte cancellate");
+
+static cl::opt<bool> ParallelDiscovery("localopts-parallel", cl::init(true), cl::Hidden,
+                                       cl::desc("Pianifica in parallelo, su tutte le funzioni del modulo, le riscritture da applicare"));
+
+/**
+ * Le riscritture non stampano nulla: vengono contate dalle STATISTIC (-stats) e descritte da
+ * remark (-pass-remarks=localopts, -pass-remarks-missed=localopts o -pass-remarks-output=file.yaml).
+ * Il costo quando nessuno le richiede è il solo controllo fatto da ORE.emit().
+ */
+static void emitApplied(OptimizationRemarkEmitter &ORE, StringRef RemarkName, Instruction &I, StringRef Rule)
+{
+    ORE.emit([&]()
+             { return OptimizationRemark(DEBUG_TYPE, RemarkName, &I)
+                      << "applicata la regola " << ore::NV("Rule", Rule); });
+}
+
+// svolto a lezione ma migliorato in matchStrengthReduction
 bool runOnBasicBlock(BasicBlock &B)
 {
     for (auto &I : B)
     {
         if (Instruction::Mul == I.getOpcode())
         {
-            outs() << "Operazione: " << I << "\n";
+            LLVM_DEBUG(dbgs() << "Operazione: " << I << "\n");
 
             bool swp = false;
             ConstantInt *power2 = nullptr;
@@ -48,7 +87,7 @@ bool runOnBasicBlock(BasicBlock &B)
             if (power2 != nullptr)
             {
                 ConstantInt *shiftOp = ConstantInt::get(power2->getType(), power2->getValue().exactLogBase2());
-                outs() << "Operando: " << power2->getValue() << "\n";
+                LLVM_DEBUG(dbgs() << "Operando: " << power2->getValue() << "\n");
 
                 Instruction *NewI;
 
@@ -61,233 +100,1120 @@ bool runOnBasicBlock(BasicBlock &B)
                 I.replaceAllUsesWith(NewI);
             }
             else
-                outs() << "Nessuna potenza di 2\n";
+                LLVM_DEBUG(dbgs() << "Nessuna potenza di 2\n");
         }
     }
     return true;
 }
 
+/**
+ * WORKLIST
+ *
+ * Struttura che raccoglie le istruzioni ancora da visitare. Ogni istruzione
+ * compare al più una volta: l'insieme 'InList' scarta i doppioni in push().
+ * L'estrazione avviene dal fondo (LIFO), quindi gli user appena re-inseriti
+ * vengono visitati subito dopo l'istruzione che li ha resi ottimizzabili.
+ * Un'istruzione viene cancellata solo subito dopo essere stata estratta, quindi
+ * la lista non contiene mai puntatori a istruzioni già cancellate.
+ */
+class LocalOptsWorklist
+{
+    SmallVector<Instruction *, 256> Stack;
+    SmallPtrSet<Instruction *, 32> InList;
+
+public:
+    void push(Instruction *I)
+    {
+        if (InList.insert(I).second)
+            Stack.push_back(I);
+    }
+
+    Instruction *pop()
+    {
+        if (Stack.empty())
+            return nullptr;
+        Instruction *I = Stack.pop_back_val();
+        InList.erase(I);
+        return I;
+    }
+};
+
+/**
+ * COSTANTI SCALARI E VETTORIALI
+ *
+ * Le regole ragionano lane per lane, così da trattare allo stesso modo una ConstantInt,
+ * uno splat (<8 x i32> con tutte le lane a 8) o un vettore costante non uniforme.
+ * forEachLane() visita le lane di una costante intera e fallisce se il valore non è
+ * costante o se una lane è undef/poison. Le lane vengono lette come APInt, senza creare
+ * nuove costanti nel contesto.
+ */
+static bool forEachLane(Value *V, function_ref<bool(const APInt &)> Pred)
+{
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(V))
+        return Pred(CI->getValue());
+
+    Type *Ty = V->getType();
+    if (!Ty->isIntOrIntVectorTy() || !Ty->isVectorTy())
+        return false;
+
+    if (isa<ConstantAggregateZero>(V))
+        return Pred(APInt::getZero(Ty->getScalarSizeInBits()));
+
+    if (ConstantDataVector *CDV = dyn_cast<ConstantDataVector>(V))
+    {
+        for (unsigned i = 0, e = CDV->getNumElements(); i != e; ++i)
+            if (!Pred(CDV->getElementAsAPInt(i)))
+                return false;
+        return true;
+    }
+
+    if (ConstantVector *CV = dyn_cast<ConstantVector>(V))
+    {
+        for (Value *Elt : CV->operands())
+        {
+            ConstantInt *CI = dyn_cast<ConstantInt>(Elt);
+            if (!CI || !Pred(CI->getValue()))
+                return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Lane di K trasformate da F, come APInt: la costante vera la costruisce buildLanes() quando si applica il piano
+static void mapLanes(Value *K, function_ref<APInt(const APInt &)> F, SmallVectorImpl<APInt> &Out)
+{
+    forEachLane(K, [&](const APInt &Lane)
+                {
+                    Out.push_back(F(Lane));
+                    return true; });
+}
+
+// Costruisce una costante del tipo Ty con le lane date; una sola lane viene ripetuta su tutto il vettore
+static Constant *buildLanes(Type *Ty, ArrayRef<APInt> Lanes)
+{
+    Type *EltTy = Ty->getScalarType();
+    if (!Ty->isVectorTy())
+        return ConstantInt::get(EltTy, Lanes.front());
+    if (Lanes.size() == 1)
+        return ConstantVector::getSplat(cast<VectorType>(Ty)->getElementCount(), ConstantInt::get(EltTy, Lanes.front()));
+
+    SmallVector<Constant *, 16> Elts;
+    for (const APInt &Lane : Lanes)
+        Elts.push_back(ConstantInt::get(EltTy, Lane));
+    return ConstantVector::get(Elts);
+}
+
+/**
+ * TABELLA DELLE IDENTITÀ ALGEBRICHE
+ *
+ * Ogni identità è descritta una sola volta come regola dichiarativa "x op K => R", dove:
+ *  - Pattern è la forma che deve avere il secondo operando K (0, 1, ~0 oppure x stesso);
+ *  - Result è il valore che sostituisce l'istruzione (x, 0 oppure ~0).
+ * La posizione dell'operando costante non va gestita a mano: per gli opcode commutativi
+ * il matcher prova da solo entrambi gli ordini.
+ *
+ * Per aggiungere un'identità basta aggiungere una riga alla tabella, tenendo vicine le
+ * regole con lo stesso opcode (lo verifica lo static_assert più sotto).
+ */
+enum class OperandPattern : uint8_t
+{
+    Zero,
+    One,
+    AllOnes,
+    Same
+};
+
+enum class RuleResult : uint8_t
+{
+    X,
+    Zero,
+    AllOnes
+};
+
+struct IdentityRule
+{
+    unsigned Opcode;
+    OperandPattern Pattern;
+    RuleResult Result;
+    const char *Name;
+};
+
+static constexpr IdentityRule IdentityRules[] = {
+    {Instruction::Add, OperandPattern::Zero, RuleResult::X, "x+0"},
+    {Instruction::Sub, OperandPattern::Zero, RuleResult::X, "x-0"},
+    {Instruction::Sub, OperandPattern::Same, RuleResult::Zero, "x-x"},
+    {Instruction::Mul, OperandPattern::One, RuleResult::X, "x*1"},
+    {Instruction::Mul, OperandPattern::Zero, RuleResult::Zero, "x*0"},
+    {Instruction::UDiv, OperandPattern::One, RuleResult::X, "x/1"},
+    {Instruction::SDiv, OperandPattern::One, RuleResult::X, "x/1"},
+    {Instruction::URem, OperandPattern::One, RuleResult::Zero, "x%1"},
+    {Instruction::SRem, OperandPattern::One, RuleResult::Zero, "x%1"},
+    {Instruction::Shl, OperandPattern::Zero, RuleResult::X, "x<<0"},
+    {Instruction::LShr, OperandPattern::Zero, RuleResult::X, "x>>0"},
+    {Instruction::AShr, OperandPattern::Zero, RuleResult::X, "x>>0"},
+    {Instruction::And, OperandPattern::Zero, RuleResult::Zero, "x&0"},
+    {Instruction::And, OperandPattern::AllOnes, RuleResult::X, "x&~0"},
+    {Instruction::And, OperandPattern::Same, RuleResult::X, "x&x"},
+    {Instruction::Or, OperandPattern::Zero, RuleResult::X, "x|0"},
+    {Instruction::Or, OperandPattern::AllOnes, RuleResult::AllOnes, "x|~0"},
+    {Instruction::Or, OperandPattern::Same, RuleResult::X, "x|x"},
+    {Instruction::Xor, OperandPattern::Zero, RuleResult::X, "x^0"},
+    {Instruction::Xor, OperandPattern::Same, RuleResult::Zero, "x^x"},
+};
+
+static constexpr unsigned NumIdentityRules = sizeof(IdentityRules) / sizeof(IdentityRules[0]);
+
+/**
+ * Dispatch per opcode, calcolato a tempo di compilazione: per ogni opcode binario
+ * l'intervallo [Begin, End) delle sue regole in IdentityRules. A runtime il matcher
+ * guarda solo le regole dell'opcode dell'istruzione, senza catene di if.
+ */
+struct RuleRange
+{
+    uint8_t Begin;
+    uint8_t End;
+};
+
+struct RuleDispatchTable
+{
+    RuleRange Ranges[Instruction::BinaryOpsEnd];
+};
+
+static constexpr bool isGroupedByOpcode()
+{
+    for (unsigned i = 1; i < NumIdentityRules; ++i)
+        for (unsigned j = 0; j + 1 < i; ++j)
+            if (IdentityRules[j].Opcode == IdentityRules[i].Opcode &&
+                IdentityRules[i - 1].Opcode != IdentityRules[i].Opcode)
+                return false;
+    return true;
+}
+
+static_assert(isGroupedByOpcode(), "Le regole con lo stesso opcode devono essere contigue");
+
+static constexpr RuleDispatchTable buildDispatchTable()
+{
+    RuleDispatchTable Table{};
+    for (unsigned i = 0; i < NumIdentityRules; ++i)
+    {
+        RuleRange &Range = Table.Ranges[IdentityRules[i].Opcode];
+        if (Range.Begin == Range.End)
+            Range.Begin = i;
+        Range.End = i + 1;
+    }
+    return Table;
+}
+
+static constexpr RuleDispatchTable IdentityDispatch = buildDispatchTable();
+
+// Controlla che K abbia la forma richiesta dalla regola, rispetto all'altro operando x
+static bool matchesPattern(OperandPattern Pattern, Value *K, Value *x)
+{
+    if (Pattern == OperandPattern::Same)
+        return K == x;
+
+    switch (Pattern)
+    {
+    case OperandPattern::Zero:
+        return forEachLane(K, [](const APInt &Lane)
+                           { return Lane.isZero(); });
+    case OperandPattern::One:
+        return forEachLane(K, [](const APInt &Lane)
+                           { return Lane.isOne(); });
+    case OperandPattern::AllOnes:
+        return forEachLane(K, [](const APInt &Lane)
+                           { return Lane.isAllOnes(); });
+    default:
+        return false;
+    }
+}
+
+static Value *buildResult(RuleResult Result, Instruction &I, Value *x)
+{
+    switch (Result)
+    {
+    case RuleResult::X:
+        return x;
+    case RuleResult::Zero:
+        return Constant::getNullValue(I.getType());
+    case RuleResult::AllOnes:
+        return Constant::getAllOnesValue(I.getType());
+    }
+    return nullptr;
+}
+
+/**
+ * PIANO DI RISCRITTURA
+ *
+ * Ogni regola è divisa in due metà:
+ *  - match*() legge l'IR e calcola tutto quello che serve (la regola scelta, le lane delle nuove
+ *    costanti, i magic number, la sequenza shift/add) senza creare nulla nel LLVMContext condiviso,
+ *    e lo descrive in un PlannedRewrite;
+ *  - applyRewrite() costruisce le costanti e le istruzioni del piano ed emette remark e statistiche.
+ * Le match*() possono quindi girare in parallelo su funzioni diverse (vedi LocalOpts::run), mentre
+ * applyRewrite() gira solo nella fase seriale.
+ *
+ * Un piano resta valido finché l'istruzione ha gli stessi operandi e, per le catene di costanti,
+ * finché li ha anche l'anello interno: Sources e InnerSources ne conservano una copia.
+ */
+enum class RuleFamily : uint8_t
+{
+    AlgebraicIdentity,
+    MultiInstruction,
+    StrengthReduction,
+    DivisionLowering
+};
+
+// Passo di una sequenza shift/add, descritto in SEQUENZE SHIFT/ADD
+struct ShiftAddStep
+{
+    unsigned Opcode;
+    unsigned LHS;
+    unsigned RHS;
+    unsigned Shift;
+};
+
+using ShiftAddSequence = SmallVector<ShiftAddStep, 8>;
+
+static constexpr unsigned ZeroValue = ~0u;
+
+struct PlannedRewrite
+{
+    enum KindTy : uint8_t
+    {
+        None,
+        Replace,      // I diventa X, 0 oppure ~0 (Result)
+        BinOpLanes,   // X Opcode C, con C costruita da Lanes
+        Negate,       // 0 - X
+        ShiftAdd,     // Seq applicata a X
+        LaneShiftAdd, // (X << C) Opcode X, con C costruita da Lanes
+        UDivMagic,    // X / D unsigned: pre-shift Shift, magic number M, S e Add (o il resto se IsRem)
+        SDivPow2,     // X / D con segno, |D| = 2^Shift (o il resto)
+        SDivMagic,    // X / D con segno: magic number M e S (o il resto)
+        Missed        // nessuna riscrittura possibile o conveniente: solo la remark, con il motivo in Rule
+    };
+
+    KindTy Kind = None;
+    RuleFamily Family = RuleFamily::AlgebraicIdentity;
+    const char *Rule = "";
+    Value *X = nullptr;
+    unsigned Opcode = 0;
+    RuleResult Result = RuleResult::X;
+    SmallVector<APInt, 4> Lanes;
+    ShiftAddSequence Seq;
+    APInt D, M;
+    unsigned S = 0, Shift = 0;
+    bool Add = false, IsRem = false;
+
+    Value *Sources[2] = {};
+    User *Inner = nullptr;
+    Value *InnerSources[2] = {};
+};
+
+static bool isPlanValid(Instruction &I, const PlannedRewrite &P)
+{
+    if (I.getOperand(0) != P.Sources[0] || I.getOperand(1) != P.Sources[1])
+        return false;
+    // I usa ancora l'anello interno, che quindi non è stato cancellato
+    return !P.Inner || (P.Inner->getOperand(0) == P.InnerSources[0] && P.Inner->getOperand(1) == P.InnerSources[1]);
+}
+
 /**
  * ALGEBRAIC IDENTITIES FUNCTION
  *
- * Un'identità algebrica è possibile nei seguenti casi:
+ * Un'identità algebrica è possibile nei casi elencati in IdentityRules, ad esempio:
  *  1. x+0 = 0+x => x
  *  2. x*1 = 1*x => x
+ *  3. x-x = x^x => 0
  *
- * La funzione esegue un controllo cercando di capire, prima di tutto, se l'opcode corrisponde
- * a una moltiplicazione o a un'addizione.
- * In tal caso, procede a definire una variabile 'imm' null e a controllare che il secondo operatore
- * sia un valore costante. Se è costante, controlla che sia 0 in caso di addizione o 1 in caso di moltiplicazione.
- * Potrbbe però anche essere che l'operatore costante sia il primo. Pertanto, se imm è null vuol dire che il
- * secondo operando NON è una costante e vale la pena controllare il primo. Si ripetono quindi i controlli,
- * stavolta però sul primo operatore.
- * Il flag 'status' serve solamente a capire se c'è stata o meno un'azione.
+ * La funzione recupera dalla tabella di dispatch le regole dell'opcode di I e le prova
+ * nell'ordine (x, K); se l'opcode è commutativo prova anche (K, x). Alla prima regola
+ * soddisfatta descrive in P il valore che sostituisce I.
  */
-bool runOnAlgebraicIdentity(BasicBlock &B)
+static bool matchAlgebraicIdentity(Instruction &I, PlannedRewrite &P)
 {
-    bool status = false;
+    if (!I.isBinaryOp())
+        return false;
 
-    // Iteratore su tutte le istruzioni del BasicBlock
-    for (auto &I : B)
+    const RuleRange &Range = IdentityDispatch.Ranges[I.getOpcode()];
+    unsigned positions = I.isCommutative() ? 2 : 1;
+
+    for (unsigned r = Range.Begin; r < Range.End; ++r)
     {
-        // Controllo che l'operazione sia commutativa
-        if (Instruction::Add == I.getOpcode() || Instruction::Mul == I.getOpcode())
+        const IdentityRule &Rule = IdentityRules[r];
+        for (unsigned pos = 0; pos < positions; ++pos)
         {
-            ConstantInt *imm = nullptr;
-
-            // Controllo se il secondo operando è una costante e quale operazione sto eseguendo
-            if (ConstantInt *secOp = dyn_cast<ConstantInt>(I.getOperand(1)))
-            {
-                if (secOp->getValue().isZero() && Instruction::Add == I.getOpcode())
-                {
-                    imm = secOp;
-                    outs() << "[AlgebraicIdentity]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "Identità risolta su " << I.getOpcodeName() << " con x in prima posizione" << "\n";
-                    I.replaceAllUsesWith(I.getOperand(0));
-                    status = true;
-                }
-                else if (secOp->getValue().isOne() && Instruction::Mul == I.getOpcode())
-                {
-                    imm = secOp;
-                    outs() << "[AlgebraicIdentity]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "Identità risolta su " << I.getOpcodeName() << " con x in prima posizione" << "\n";
-                    I.replaceAllUsesWith(I.getOperand(0));
-                    status = true;
-                }
-            }
+            Value *x = I.getOperand(pos);
+            if (!matchesPattern(Rule.Pattern, I.getOperand(1 - pos), x))
+                continue;
 
-            // Controllo se il primo operando è una costante e quale operazione sto eseguendo
-            if (imm == nullptr)
-            {
-                if (ConstantInt *firOp = dyn_cast<ConstantInt>(I.getOperand(0)))
-                {
-                    if (firOp->getValue().isZero() && Instruction::Add == I.getOpcode())
-                    {
-                        imm = firOp;
-                        outs() << "[AlgebraicIdentity]: " << I.getOpcodeName() << " ->" << I << "\n";
-                        outs() << "Identità risolta su " << I.getOpcodeName() << " con x in seconda posizione" << "\n";
-                        I.replaceAllUsesWith(I.getOperand(1));
-                        status = true;
-                    }
-                    else if (firOp->getValue().isOne() && Instruction::Mul == I.getOpcode())
-                    {
-                        imm = firOp;
-                        outs() << "[AlgebraicIdentity]: " << I.getOpcodeName() << " ->" << I << "\n";
-                        outs() << "Identità risolta su " << I.getOpcodeName() << " con x in seconda posizione" << "\n";
-                        I.replaceAllUsesWith(I.getOperand(1));
-                        status = true;
-                    }
-                }
-            }
+            P.Kind = PlannedRewrite::Replace;
+            P.Family = RuleFamily::AlgebraicIdentity;
+            P.Rule = Rule.Name;
+            P.Result = Rule.Result;
+            P.X = x;
+            return true;
         }
     }
-    // Flag falso, trovato nulla
-    if (!status)
-        outs() << "Nessuna identità trovata \n";
-    outs() << "[AlgebraicIdentity] terminata \n\n";
-    return status;
+    return false;
 }
 
 /**
- * STRENGTH REDUCTION (ADVANCED)
+ * MAGIC NUMBERS (Granlund-Montgomery)
  *
- * La Strength Reduction consiste nel trasformare delle moltiplicazioni o delle divisioni in delle
- * operazioni svolte tramite shifting left o right:
- *  1. 15*x = x*15 => (x<<4) - x
- *  2. x/8 => x>>3
+ * Una divisione per una costante d può essere sostituita da una moltiplicazione per un "magic number"
+ * M ≈ 2^(bw+s)/d seguita da uno shift di s: basta prendere la metà alta del prodotto a 2*bw bit.
+ * Gli algoritmi sono quelli di Hacker's Delight (cap. 10); 'Add' indica che, nel caso unsigned,
+ * M non sta in bw bit e serve la correzione con l'addizione.
+ */
+struct SignedMagic
+{
+    APInt M;
+    unsigned S;
+};
+
+struct UnsignedMagic
+{
+    APInt M;
+    unsigned S;
+    bool Add;
+};
+
+// Richiede 2 <= |d| e d non potenza di 2 (in valore assoluto)
+static SignedMagic computeSignedMagic(const APInt &d)
+{
+    unsigned bw = d.getBitWidth();
+    APInt signedMin = APInt::getSignedMinValue(bw);
+
+    APInt ad = d.abs();
+    APInt t = signedMin + d.lshr(bw - 1);
+    APInt anc = t - 1 - t.urem(ad);
+    unsigned p = bw - 1;
+    APInt q1 = signedMin.udiv(anc);
+    APInt r1 = signedMin - q1 * anc;
+    APInt q2 = signedMin.udiv(ad);
+    APInt r2 = signedMin - q2 * ad;
+    APInt delta;
+
+    do
+    {
+        p = p + 1;
+        q1 = q1.shl(1);
+        r1 = r1.shl(1);
+        if (r1.uge(anc))
+        {
+            q1 = q1 + 1;
+            r1 = r1 - anc;
+        }
+        q2 = q2.shl(1);
+        r2 = r2.shl(1);
+        if (r2.uge(ad))
+        {
+            q2 = q2 + 1;
+            r2 = r2 - ad;
+        }
+        delta = ad - r2;
+    } while (q1.ult(delta) || (q1 == delta && r1.isZero()));
+
+    SignedMagic Mag;
+    Mag.M = q2 + 1;
+    if (d.isNegative())
+        Mag.M = -Mag.M;
+    Mag.S = p - bw;
+    return Mag;
+}
+
+// Richiede d > 1; LeadingZeros indica quanti bit alti del dividendo sono noti essere zero
+static UnsignedMagic computeUnsignedMagic(const APInt &d, unsigned LeadingZeros = 0)
+{
+    unsigned bw = d.getBitWidth();
+    APInt allOnes = APInt::getAllOnes(bw).lshr(LeadingZeros);
+    APInt signedMin = APInt::getSignedMinValue(bw);
+    APInt signedMax = APInt::getSignedMaxValue(bw);
+
+    UnsignedMagic Mag;
+    Mag.Add = false;
+
+    APInt nc = allOnes - (allOnes - d).urem(d);
+    unsigned p = bw - 1;
+    APInt q1 = signedMin.udiv(nc);
+    APInt r1 = signedMin - q1 * nc;
+    APInt q2 = signedMax.udiv(d);
+    APInt r2 = signedMax - q2 * d;
+    APInt delta;
+
+    do
+    {
+        p = p + 1;
+        if (r1.uge(nc - r1))
+        {
+            q1 = q1 + q1 + 1;
+            r1 = r1 + r1 - nc;
+        }
+        else
+        {
+            q1 = q1 + q1;
+            r1 = r1 + r1;
+        }
+        if ((r2 + 1).uge(d - r2))
+        {
+            if (q2.uge(signedMax))
+                Mag.Add = true;
+            q2 = q2 + q2 + 1;
+            r2 = r2 + r2 + 1 - d;
+        }
+        else
+        {
+            if (q2.uge(signedMin))
+                Mag.Add = true;
+            q2 = q2 + q2;
+            r2 = r2 + r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while (p < bw * 2 && (q1.ult(delta) || (q1 == delta && r1.isZero())));
+
+    Mag.M = q2 + 1;
+    Mag.S = p - bw;
+    return Mag;
+}
+
+// Metà alta del prodotto x*M, calcolata su 2*bw bit
+static Value *createMulHigh(IRBuilderBase &Builder, Value *x, const APInt &M, bool isSigned)
+{
+    Type *Ty = x->getType();
+    unsigned bw = Ty->getScalarSizeInBits();
+    Type *WideTy = Ty->getWithNewBitWidth(2 * bw);
+
+    Value *WideX = isSigned ? Builder.CreateSExt(x, WideTy) : Builder.CreateZExt(x, WideTy);
+    APInt WideM = isSigned ? M.sext(2 * bw) : M.zext(2 * bw);
+    Value *Prod = Builder.CreateMul(WideX, ConstantInt::get(WideTy, WideM));
+    return Builder.CreateTrunc(Builder.CreateLShr(Prod, bw), Ty);
+}
+
+// Legge il valore comune a tutte le lane; fallisce se la costante non è uniforme
+static bool getUniformLane(Value *V, APInt &Out)
+{
+    bool first = true;
+    return forEachLane(V, [&](const APInt &Lane)
+                       {
+                           if (first)
+                           {
+                               Out = Lane;
+                               first = false;
+                               return true;
+                           }
+                           return Lane == Out; });
+}
+
+// q = x / d con segno, per |d| = 2^k, k >= 1: si aggiunge il bias (2^k - 1) ai negativi prima dello shift aritmetico
+static Value *createSDivPow2(IRBuilderBase &Builder, Value *x, unsigned k)
+{
+    unsigned bw = x->getType()->getScalarSizeInBits();
+    Value *sign = Builder.CreateAShr(x, bw - 1);
+    Value *bias = Builder.CreateLShr(sign, bw - k);
+    return Builder.CreateAdd(x, bias);
+}
+
+static Value *createUDivMagic(IRBuilderBase &Builder, Value *x, const PlannedRewrite &P)
+{
+    // d >= 2^(bw-1): il quoziente può valere solo 0 o 1
+    if (P.D.isNegative())
+        return Builder.CreateZExt(Builder.CreateICmpUGE(x, ConstantInt::get(x->getType(), P.D)), x->getType());
+
+    // Con d pari il piano può dividere prima per la potenza di 2 contenuta in d, evitando la correzione
+    Value *q = P.Shift ? Builder.CreateLShr(x, P.Shift) : x;
+    q = createMulHigh(Builder, q, P.M, false);
+    if (!P.Add)
+        return P.S ? Builder.CreateLShr(q, P.S) : q;
+
+    Value *npq = Builder.CreateLShr(Builder.CreateSub(x, q), 1);
+    return Builder.CreateLShr(Builder.CreateAdd(npq, q), P.S - 1);
+}
+
+static Value *createSDivMagic(IRBuilderBase &Builder, Value *x, const PlannedRewrite &P)
+{
+    unsigned bw = P.D.getBitWidth();
+
+    Value *q = createMulHigh(Builder, x, P.M, true);
+    if (P.D.isStrictlyPositive() && P.M.isNegative())
+        q = Builder.CreateAdd(q, x);
+    if (P.D.isNegative() && P.M.isStrictlyPositive())
+        q = Builder.CreateSub(q, x);
+    if (P.S)
+        q = Builder.CreateAShr(q, P.S);
+
+    // Arrotondamento verso zero: +1 se il quoziente provvisorio è negativo
+    return Builder.CreateAdd(q, Builder.CreateLShr(q, bw - 1));
+}
+
+/**
+ * DIVISION LOWERING
  *
- * Un vincolo da rispettare è che le costanti devono, ovviamente, essere potenze di 2 o un numero che si avvicina
- * alle potenze di 2 di ±1 (come nell'esempio di prima con 15).
- * Dapprima si controlla che l'opcode sia o una moltiplicazione o una divisione, casi che andranno trattati a
- * parte per via della proprietà commutativa della moltiplicazione (non presente nella divisione).
+ * Divisioni e resti per costante vengono sostituiti da sequenze senza divisione hardware:
+ *  1. udiv x, 2^k  => x >> k (logico)
+ *  2. urem x, 2^k  => x & (2^k - 1)
+ *  3. sdiv x, ±2^k => (x + bias) >> k (aritmetico), con bias = 2^k - 1 solo se x < 0; negato se d < 0
+ *  4. srem x, ±2^k => x - ((x + bias) & -2^k)
+ *  5. udiv/sdiv per una costante qualsiasi => moltiplicazione per il magic number (metà alta) e shift
+ *  6. urem/srem per una costante qualsiasi => x - (x/d)*d, riusando il caso 5
  *
- * CASO MUL :
- * Successivamente, si controlla quale dei due operandi è quello costante. Nel caso del primo operando costante,
- * il flag 'swp' sarà true. Se quindi il valore di 'imm' non è null (ergo, uno dei due operatori è costante) e
- * il valore della moltiplicazione non è 1 (altrimenti si avrebbe una algebraic identity), si procede col calcolo.
- * Si controlla che 'imm' sia una potenza di 2, affinché si possa semplificare con una semplice istruzione di shifting.
- * In altro caso, si controlla che o 'val+1' o 'val-1' siano potenze di 2. In questo caso, sono due le istruzioni da
- * creare, una per lo shifting, l'altra per l'addizione/sottrazione di val.
+ * Il semplice shift logico usato in passato per sdiv non era corretto per x negativo: -7/2 deve dare -3,
+ * mentre -7>>1 dà -4 (e il logico un numero enorme). Il bias corregge l'arrotondamento verso zero.
  *
- * CASO DIV :
- * Uguale a prima, con la differenza che qua ci dev'essere una potenza esatta di 2 per funzionare.
- * Inoltre, lo swap non si può fare perché la proprietà commutativa non è presente per le divisioni.
+ * Nei casi 1 e 2 ogni lane di un vettore può avere una potenza di 2 diversa; negli altri casi il
+ * divisore deve essere uniforme, perché la forma della sequenza dipende dalla costante.
+ * Un divisore costante che non rientra in nessun caso (nullo, con lane undef o vettoriale non
+ * uniforme) produce un piano Missed con il motivo.
  */
-bool runOnBasicBlockAdv(BasicBlock &B)
+static bool matchDivisionLowering(Instruction &I, PlannedRewrite &P)
 {
-    for (auto &I : B)
+    unsigned Opcode = I.getOpcode();
+    if (Opcode != Instruction::UDiv && Opcode != Instruction::URem &&
+        Opcode != Instruction::SDiv && Opcode != Instruction::SRem)
+        return false;
+
+    Value *imm = I.getOperand(1);
+    bool isUnsigned = Opcode == Instruction::UDiv || Opcode == Instruction::URem;
+
+    if (!isa<Constant>(imm) || isa<ConstantExpr>(imm))
+        return false;
+
+    auto plan = [&](PlannedRewrite::KindTy Kind, const char *Rule)
     {
-        if (Instruction::Mul == I.getOpcode())
+        P.Kind = Kind;
+        P.Family = RuleFamily::DivisionLowering;
+        P.Rule = Rule;
+        P.X = I.getOperand(0);
+        P.IsRem = Opcode == Instruction::URem || Opcode == Instruction::SRem;
+        return true;
+    };
+
+    // Divisione per zero (UB) o costanti con lane undef: non si tocca nulla
+    if (!forEachLane(imm, [](const APInt &v)
+                     { return !v.isZero(); }))
+        return plan(PlannedRewrite::Missed, "divisore nullo o con lane undef");
+
+    if (isUnsigned && forEachLane(imm, [](const APInt &v)
+                                  { return v.isPowerOf2(); }))
+    {
+        if (Opcode == Instruction::UDiv)
         {
-            bool swp = false;
-            ConstantInt *imm = nullptr;
+            P.Opcode = Instruction::LShr;
+            mapLanes(imm, [](const APInt &v)
+                     { return APInt(v.getBitWidth(), v.exactLogBase2()); }, P.Lanes);
+        }
+        else
+        {
+            P.Opcode = Instruction::And;
+            mapLanes(imm, [](const APInt &v)
+                     { return v - 1; }, P.Lanes);
+        }
+        return plan(PlannedRewrite::BinOpLanes, "potenza di 2 unsigned");
+    }
 
-            if (ConstantInt *secOp = dyn_cast<ConstantInt>(I.getOperand(1)))
-                imm = secOp;
-            else if (ConstantInt *firOp = dyn_cast<ConstantInt>(I.getOperand(0)))
+    APInt d;
+    if (!getUniformLane(imm, d))
+        return plan(PlannedRewrite::Missed, "divisore vettoriale non uniforme e non potenza di 2 unsigned su ogni lane");
+    if (d.isOne())
+        return false;
+    P.D = d;
+
+    if (isUnsigned)
+    {
+        if (!d.isNegative())
+        {
+            UnsignedMagic Mag = computeUnsignedMagic(d);
+            if (Mag.Add && !d[0])
             {
-                imm = firOp;
-                swp = true;
+                P.Shift = d.countTrailingZeros();
+                Mag = computeUnsignedMagic(d.lshr(P.Shift), P.Shift);
             }
+            P.M = Mag.M;
+            P.S = Mag.S;
+            P.Add = Mag.Add;
+        }
+        return plan(PlannedRewrite::UDivMagic, "magic number unsigned");
+    }
 
-            if (imm != nullptr && !imm->getValue().isOne())
-            {
-                APInt val = imm->getValue();
-                if (val.isPowerOf2())
-                {
-                    ConstantInt *shiftOp = ConstantInt::get(imm->getType(), imm->getValue().exactLogBase2());
-                    outs() << "[StrengthReduction]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "Immediato potenza di 2 -> shift x<<" << shiftOp->getValue() << "\n";
+    // x / -1 = -x, x % -1 = 0 (il caso INT_MIN / -1 è UB)
+    if (d.isAllOnes())
+    {
+        if (Opcode == Instruction::SRem)
+            P.Result = RuleResult::Zero;
+        return plan(Opcode == Instruction::SDiv ? PlannedRewrite::Negate : PlannedRewrite::Replace, "divisore -1");
+    }
 
-                    Instruction *NewI_1;
+    APInt ad = d.abs();
+    if (ad.isPowerOf2())
+    {
+        P.Shift = ad.exactLogBase2();
+        return plan(PlannedRewrite::SDivPow2, "potenza di 2 signed");
+    }
 
-                    if (swp)
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(1), shiftOp);
-                    else
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(0), shiftOp);
+    SignedMagic Mag = computeSignedMagic(d);
+    P.M = Mag.M;
+    P.S = Mag.S;
+    return plan(PlannedRewrite::SDivMagic, "magic number signed");
+}
 
-                    NewI_1->insertAfter(&I);
-                    I.replaceAllUsesWith(NewI_1);
-                }
-                else if ((val + 1).isPowerOf2())
-                {
-                    ConstantInt *shiftOp = ConstantInt::get(imm->getType(), imm->getValue().nearestLogBase2());
-                    outs() << "[StrengthReduction]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "(immediato+1) potenza di 2 -> shift x<<" << shiftOp->getValue() << " e aggiunta una sub \n";
+/**
+ * SEQUENZE SHIFT/ADD
+ *
+ * Una moltiplicazione per costante c può essere scritta come combinazione di shift e
+ * addizioni/sottrazioni di x. La sequenza è una lista di passi; il valore 0 è x e ogni passo
+ * produce un nuovo valore a partire da quelli precedenti:
+ *  - Shl: V[LHS] << Shift
+ *  - Add: V[LHS] + V[RHS]
+ *  - Sub: V[LHS] - V[RHS] (con LHS = ZeroValue si ottiene la negazione)
+ *
+ * I candidati generati sono:
+ *  1. forma di Horner sulla ricodifica NAF (cifre in {-1, 0, 1}, mai due cifre non nulle adiacenti):
+ *     ad esempio 1000 = 1024 - 32 + 8 => ((((x<<5) - x)<<2) + x)<<3
+ *  2. somma dei termini NAF, utile quando la cifra più alta è negativa (-3*x => x - (x<<2))
+ *  3. fattorizzazione per 2^a ± 1, ad esempio 45 = 5 * 9 => t = (x<<2) + x; (t<<3) + t
+ */
 
-                    Instruction *NewI_1;
-                    Instruction *NewI_2;
+// Indice del valore prodotto dall'ultimo passo (0 = x se la sequenza è vuota)
+static unsigned lastValue(const ShiftAddSequence &Seq)
+{
+    return Seq.size();
+}
 
-                    if (swp)
-                    {
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(1), shiftOp);
-                        NewI_2 = BinaryOperator::Create(Instruction::Sub, NewI_1, I.getOperand(1));
-                    }
-                    else
-                    {
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(0), shiftOp);
-                        NewI_2 = BinaryOperator::Create(Instruction::Sub, NewI_1, I.getOperand(0));
-                    }
+static unsigned appendStep(ShiftAddSequence &Seq, unsigned Opcode, unsigned LHS, unsigned RHS, unsigned Shift = 0)
+{
+    Seq.push_back({Opcode, LHS, RHS, Shift});
+    return lastValue(Seq);
+}
 
-                    NewI_1->insertAfter(&I);
-                    NewI_2->insertAfter(NewI_1);
-                    I.replaceAllUsesWith(NewI_2);
-                }
-                else if ((val - 1).isPowerOf2())
-                {
-                    ConstantInt *shiftOp = ConstantInt::get(imm->getType(), imm->getValue().nearestLogBase2());
-                    outs() << "[StrengthReduction]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "(immediato-1) potenza di 2 -> shift x<<" << shiftOp->getValue() << " e aggiunta una add \n";
+// Cifre NAF di c (modulo 2^bw): Digits[i] è il coefficiente di 2^i
+static void computeNAF(const APInt &c, SmallVectorImpl<int> &Digits)
+{
+    unsigned bw = c.getBitWidth();
+    APInt v = c.zext(bw + 2);
+    Digits.assign(bw, 0);
 
-                    Instruction *NewI_1;
-                    Instruction *NewI_2;
+    for (unsigned i = 0; i < bw && !v.isZero(); ++i)
+    {
+        if (v[0])
+        {
+            // v mod 4 == 1 => cifra 1, v mod 4 == 3 => cifra -1
+            int digit = v[1] ? -1 : 1;
+            Digits[i] = digit;
+            if (digit == 1)
+                v = v - 1;
+            else
+                v = v + 1;
+        }
+        v = v.lshr(1);
+    }
+}
 
-                    if (swp)
-                    {
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(1), shiftOp);
-                        NewI_2 = BinaryOperator::Create(Instruction::Add, NewI_1, I.getOperand(1));
-                    }
-                    else
-                    {
-                        NewI_1 = BinaryOperator::Create(Instruction::Shl, I.getOperand(0), shiftOp);
-                        NewI_2 = BinaryOperator::Create(Instruction::Add, NewI_1, I.getOperand(0));
-                    }
+static bool buildHornerNAF(ArrayRef<int> Digits, ShiftAddSequence &Seq)
+{
+    int top = -1;
+    for (int i = Digits.size() - 1; i >= 0; --i)
+        if (Digits[i] != 0)
+        {
+            top = i;
+            break;
+        }
+    if (top < 0)
+        return false;
 
-                    NewI_1->insertAfter(&I);
-                    NewI_2->insertAfter(NewI_1);
-                    I.replaceAllUsesWith(NewI_2);
-                }
-            }
+    unsigned acc = 0;
+    if (Digits[top] < 0)
+        acc = appendStep(Seq, Instruction::Sub, ZeroValue, 0);
+
+    int last = top;
+    for (int i = top - 1; i >= 0; --i)
+    {
+        if (Digits[i] == 0)
+            continue;
+        acc = appendStep(Seq, Instruction::Shl, acc, 0, last - i);
+        acc = appendStep(Seq, Digits[i] > 0 ? Instruction::Add : Instruction::Sub, acc, 0);
+        last = i;
+    }
+    if (last > 0)
+        appendStep(Seq, Instruction::Shl, acc, 0, last);
+    return true;
+}
+
+static bool buildSumNAF(ArrayRef<int> Digits, ShiftAddSequence &Seq)
+{
+    // Si parte da un termine positivo, così da evitare la negazione quando possibile
+    int first = -1;
+    for (unsigned i = 0; i < Digits.size(); ++i)
+        if (Digits[i] > 0)
+        {
+            first = i;
+            break;
         }
-        else if (Instruction::SDiv == I.getOpcode())
+
+    unsigned acc = ZeroValue;
+    if (first >= 0)
+        acc = first ? appendStep(Seq, Instruction::Shl, 0, 0, first) : 0;
+
+    for (unsigned i = 0; i < Digits.size(); ++i)
+    {
+        if (Digits[i] == 0 || (int)i == first)
+            continue;
+        unsigned term = i ? appendStep(Seq, Instruction::Shl, 0, 0, i) : 0;
+        acc = appendStep(Seq, Digits[i] > 0 ? Instruction::Add : Instruction::Sub, acc, term);
+    }
+    return acc != ZeroValue;
+}
+
+// Ricerca per fattori 2^a ± 1 (profondità limitata), con il resto espresso in NAF; Seq parte vuota
+static bool buildFactored(const APInt &c, unsigned Depth, ShiftAddSequence &Seq)
+{
+    unsigned bw = c.getBitWidth();
+    if (c.isOne())
+        return true;
+    if (c.isZero())
+        return false;
+
+    unsigned tz = c.countTrailingZeros();
+    if (tz)
+    {
+        if (!buildFactored(c.lshr(tz), Depth, Seq))
+            return false;
+        appendStep(Seq, Instruction::Shl, lastValue(Seq), 0, tz);
+        return true;
+    }
+
+    // Senza fattori la sequenza è la forma di Horner; ogni fattorizzazione più corta la rimpiazza
+    SmallVector<int, 64> Digits;
+    computeNAF(c, Digits);
+    buildHornerNAF(Digits, Seq);
+
+    if (Depth == 0)
+        return true;
+
+    for (unsigned a = 2; a < bw; ++a)
+    {
+        for (int sign = -1; sign <= 1; sign += 2)
         {
-            ConstantInt *imm = nullptr;
+            APInt f = APInt::getOneBitSet(bw, a);
+            f = sign < 0 ? f - 1 : f + 1;
+            if (f == c || !c.urem(f).isZero())
+                continue;
 
-            if (ConstantInt *secOp = dyn_cast<ConstantInt>(I.getOperand(1)))
-                imm = secOp;
+            ShiftAddSequence Sub;
+            if (!buildFactored(c.udiv(f), Depth - 1, Sub) || Sub.size() + 2 >= Seq.size())
+                continue;
+            unsigned t = lastValue(Sub);
+            unsigned s = appendStep(Sub, Instruction::Shl, t, 0, a);
+            appendStep(Sub, sign < 0 ? Instruction::Sub : Instruction::Add, s, t);
+            Seq = std::move(Sub);
+        }
+    }
+    return true;
+}
 
-            if (imm != nullptr)
-            {
-                if (imm->getValue().isPowerOf2())
-                {
-                    ConstantInt *shiftOp = ConstantInt::get(imm->getType(), imm->getValue().nearestLogBase2());
-                    outs() << "[StrengthReduction]: " << I.getOpcodeName() << " ->" << I << "\n";
-                    outs() << "Immediato potenza di 2 -> shift x>>" << shiftOp->getValue() << "\n";
+// Latenze sul target delle operazioni che una sequenza può sostituire o usare
+struct ShiftAddCosts
+{
+    InstructionCost Mul;
+    InstructionCost Shl;
+    InstructionCost Add;
+    InstructionCost Sub;
+};
 
-                    Instruction *NewI_1;
+static InstructionCost getSequenceCost(const ShiftAddSequence &Seq, const ShiftAddCosts &Costs)
+{
+    InstructionCost Cost = 0;
+    for (const ShiftAddStep &Step : Seq)
+        Cost += Step.Opcode == Instruction::Shl ? Costs.Shl : Step.Opcode == Instruction::Add ? Costs.Add
+                                                                                             : Costs.Sub;
+    return Cost;
+}
 
-                    NewI_1 = BinaryOperator::Create(Instruction::LShr, I.getOperand(0), shiftOp);
+// Sceglie la sequenza più economica tra i candidati; false se nessuna batte la mul nativa
+static bool findShiftAddSequence(const APInt &c, const ShiftAddCosts &Costs, ShiftAddSequence &Best)
+{
+    InstructionCost BestCost = Costs.Mul;
+    if (!BestCost.isValid())
+        return false;
 
-                    NewI_1->insertAfter(&I);
-                    I.replaceAllUsesWith(NewI_1);
-                }
-            }
+    // Per una costante che non è una potenza di 2 ogni candidato ha almeno uno shift e una add/sub
+    // (solo la negazione per -1): se già questo non costa meno della mul, la ricerca è inutile
+    InstructionCost MinCost = c.isAllOnes() ? Costs.Sub : Costs.Shl + std::min(Costs.Add, Costs.Sub);
+    if (!MinCost.isValid() || !(MinCost < BestCost))
+        return false;
+
+    SmallVector<int, 64> Digits;
+    computeNAF(c, Digits);
+
+    ShiftAddSequence Candidates[3];
+    bool Valid[3] = {buildHornerNAF(Digits, Candidates[0]),
+                     buildSumNAF(Digits, Candidates[1]),
+                     buildFactored(c, 2, Candidates[2])};
+
+    bool found = false;
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        if (!Valid[i])
+            continue;
+        InstructionCost Cost = getSequenceCost(Candidates[i], Costs);
+        if (Cost.isValid() && Cost < BestCost)
+        {
+            BestCost = Cost;
+            Best = Candidates[i];
+            found = true;
         }
     }
-    outs() << "[StrengthReduction] terminata \n\n";
+    return found;
+}
+
+// Le query al TargetTransformInfo possono creare tipi nel LLVMContext condiviso (ad esempio per
+// legalizzare un vettore): quelle fatte durante la pianificazione parallela passano da qui una alla volta
+static std::mutex TTIMutex;
+
+/**
+ * Costi per tipo e risultati di findShiftAddSequence per (tipo, costante), di una sola funzione.
+ * La fattorizzazione prova O(bw^2) divisori, quindi ogni costante va cercata una sola volta anche
+ * se compare in molte moltiplicazioni. La cache vive quanto il TargetTransformInfo della funzione,
+ * da cui dipendono i costi, e la usa un thread alla volta.
+ */
+class ShiftAddCache
+{
+    struct Entry
+    {
+        bool Found;
+        ShiftAddSequence Seq;
+    };
+
+    const TargetTransformInfo &TTI;
+    DenseMap<Type *, ShiftAddCosts> Costs;
+    DenseMap<std::pair<Type *, APInt>, Entry> Entries;
+
+public:
+    explicit ShiftAddCache(const TargetTransformInfo &TTI) : TTI(TTI) {}
+
+    const ShiftAddCosts &getCosts(Type *Ty)
+    {
+        auto Inserted = Costs.try_emplace(Ty);
+        ShiftAddCosts &C = Inserted.first->second;
+        if (Inserted.second)
+        {
+            std::lock_guard<std::mutex> Lock(TTIMutex);
+            C.Mul = TTI.getArithmeticInstrCost(Instruction::Mul, Ty, TargetTransformInfo::TCK_Latency);
+            C.Shl = TTI.getArithmeticInstrCost(Instruction::Shl, Ty, TargetTransformInfo::TCK_Latency);
+            C.Add = TTI.getArithmeticInstrCost(Instruction::Add, Ty, TargetTransformInfo::TCK_Latency);
+            C.Sub = TTI.getArithmeticInstrCost(Instruction::Sub, Ty, TargetTransformInfo::TCK_Latency);
+        }
+        return C;
+    }
+
+    // nullptr se nessuna sequenza batte la mul nativa
+    const ShiftAddSequence *lookup(const APInt &c, Type *Ty)
+    {
+        auto Inserted = Entries.try_emplace(std::make_pair(Ty, c));
+        Entry &E = Inserted.first->second;
+        if (Inserted.second)
+            E.Found = findShiftAddSequence(c, getCosts(Ty), E.Seq);
+        return E.Found ? &E.Seq : nullptr;
+    }
+};
+
+static Value *emitShiftAddSequence(const ShiftAddSequence &Seq, Value *x, IRBuilderBase &Builder)
+{
+    SmallVector<Value *, 16> Values;
+    Values.push_back(x);
+    auto get = [&](unsigned Idx) -> Value *
+    {
+        return Idx == ZeroValue ? Constant::getNullValue(x->getType()) : Values[Idx];
+    };
+
+    for (const ShiftAddStep &Step : Seq)
+    {
+        if (Step.Opcode == Instruction::Shl)
+            Values.push_back(Builder.CreateShl(get(Step.LHS), Step.Shift));
+        else
+            Values.push_back(Builder.CreateBinOp((Instruction::BinaryOps)Step.Opcode, get(Step.LHS), get(Step.RHS)));
+    }
+    return Values.back();
+}
+
+/**
+ * STRENGTH REDUCTION (ADVANCED)
+ *
+ * La Strength Reduction consiste nel trasformare delle moltiplicazioni in delle operazioni
+ * svolte tramite shifting left e addizioni/sottrazioni:
+ *  1. 8*x = x*8 => x<<3
+ *  2. 15*x = x*15 => (x<<4) - x
+ *  3. 10*x = x*10 => ((x<<2) + x)<<1
+ *
+ * CASO MUL :
+ * Si cerca l'operando costante in entrambe le posizioni (la moltiplicazione è commutativa).
+ * Se ogni lane è una potenza di 2 basta uno shift, che non costa mai più della mul: la riscrittura è
+ * sempre fatta, anche con quantità diverse per lane. Per le altre costanti (uniformi) si cerca la
+ * sequenza shift/add più economica e la si usa solo se, secondo il TargetTransformInfo, la sua
+ * latenza è minore di quella della mul nativa sul target; il risultato della ricerca è tenuto in
+ * ShiftAddCache, e se la mul costa già quanto uno shift più una add non la si avvia nemmeno.
+ * Per un vettore non uniforme resta il caso in cui ogni lane è 2^k+1 (o ogni lane è 2^k-1):
+ * uno shift per lane e una add (o sub). I valori 0 e 1 sono lasciati all'Algebraic Identity.
+ * Se nessuna riscrittura conviene il piano è Missed, che produce solo la remark.
+ *
+ * Le divisioni per costante sono trattate a parte da matchDivisionLowering.
+ *
+ * Le nuove istruzioni vengono create da applyRewrite tramite il Builder, posizionato prima di I:
+ * in questo modo finiscono direttamente nella worklist e possono essere ottimizzate a loro volta.
+ */
+static bool matchStrengthReduction(Instruction &I, ShiftAddCache &SeqCache, PlannedRewrite &P)
+{
+    if (Instruction::Mul != I.getOpcode())
+        return false;
+
+    auto plan = [&](PlannedRewrite::KindTy Kind, Value *x, const char *Rule)
+    {
+        P.Kind = Kind;
+        P.Family = RuleFamily::StrengthReduction;
+        P.Rule = Rule;
+        P.X = x;
+        return true;
+    };
+
+    for (unsigned pos = 0; pos < 2; ++pos)
+    {
+        Value *imm = I.getOperand(1 - pos);
+        Value *x = I.getOperand(pos);
+        Type *Ty = I.getType();
+        if (!forEachLane(imm, [](const APInt &)
+                         { return true; }))
+            continue;
+
+        if (forEachLane(imm, [](const APInt &v)
+                        { return v.isZero() || v.isOne(); }))
+            return false;
+
+        if (forEachLane(imm, [](const APInt &v)
+                        { return v.isPowerOf2(); }))
+        {
+            P.Opcode = Instruction::Shl;
+            mapLanes(imm, [](const APInt &v)
+                     { return APInt(v.getBitWidth(), v.exactLogBase2()); }, P.Lanes);
+            return plan(PlannedRewrite::BinOpLanes, x, "shift potenza di 2");
+        }
+
+        APInt c;
+        if (getUniformLane(imm, c))
+        {
+            const ShiftAddSequence *Seq = SeqCache.lookup(c, Ty);
+            if (!Seq)
+                return plan(PlannedRewrite::Missed, x, "nessuna sequenza shift/add costa meno della mul sul target");
+            P.Seq = *Seq;
+            return plan(PlannedRewrite::ShiftAdd, x, "sequenza shift/add");
+        }
+
+        for (int sign = -1; sign <= 1; sign += 2)
+        {
+            if (!forEachLane(imm, [sign](const APInt &v)
+                             { return (v - sign).isPowerOf2(); }))
+                continue;
+
+            unsigned Opcode = sign < 0 ? Instruction::Sub : Instruction::Add;
+            const ShiftAddCosts &Costs = SeqCache.getCosts(Ty);
+            InstructionCost Cost = Costs.Shl + (sign < 0 ? Costs.Sub : Costs.Add);
+            if (!Cost.isValid() || !(Cost < Costs.Mul))
+                return plan(PlannedRewrite::Missed, x, "shift per lane e add/sub non costano meno della mul sul target");
+
+            P.Opcode = Opcode;
+            mapLanes(imm, [sign](const APInt &v)
+                     { return APInt(v.getBitWidth(), (v - sign).exactLogBase2()); }, P.Lanes);
+            return plan(PlannedRewrite::LaneShiftAdd, x, "shift per lane e add/sub");
+        }
+        return false;
+    }
+    return false;
+}
+
+/**
+ * Combina lane per lane due costanti intere dello stesso tipo, mettendo i risultati in Out.
+ * Una delle due può avere una sola lane (scalare, splat o zeroinitializer), che viene allora
+ * ripetuta su tutte le lane dell'altra. Fallisce se una delle due ha lane undef o non intere.
+ */
+static bool zipLanes(Value *A, Value *B, function_ref<APInt(const APInt &, const APInt &)> F, SmallVectorImpl<APInt> &Out)
+{
+    SmallVector<APInt, 16> LanesA, LanesB;
+    auto collect = [](SmallVectorImpl<APInt> &Lanes)
+    {
+        return [&Lanes](const APInt &Lane)
+        {
+            Lanes.push_back(Lane);
+            return true;
+        };
+    };
+    if (!forEachLane(A, collect(LanesA)) || !forEachLane(B, collect(LanesB)))
+        return false;
+
+    // Uno splat "compresso" ha un'unica lane: la si replica sulle altre
+    if (LanesA.size() == 1 && LanesB.size() > 1)
+        LanesA.resize(LanesB.size(), LanesA.front());
+    if (LanesB.size() == 1 && LanesA.size() > 1)
+        LanesB.resize(LanesA.size(), LanesB.front());
+
+    for (unsigned i = 0, e = LanesA.size(); i != e; ++i)
+        Out.push_back(F(LanesA[i], LanesB[i]));
     return true;
 }
 
+/**
+ * Un anello di una catena di costanti: l'istruzione calcola X op K, con K costante senza lane undef.
+ * Le sottrazioni x-K sono normalizzate in x+(-K), così add e sub appartengono alla stessa famiglia
+ * e si possono sommare gli immediati senza distinguere i casi. K-x non è un anello: non è della
+ * forma x op K e la sua negazione non si propaga lungo la catena.
+ */
+struct ChainLink
+{
+    unsigned Opcode; // Add, Mul o Shl
+    Value *X;
+    Value *K;
+    bool Negated; // K va letto come -K (l'istruzione era una sub)
+};
+
+static bool matchChainLink(Value *V, ChainLink &Link)
+{
+    BinaryOperator *BO = dyn_cast<BinaryOperator>(V);
+    if (!BO)
+        return false;
+
+    auto concrete = [](Value *K)
+    { return forEachLane(K, [](const APInt &)
+                         { return true; }); };
+
+    switch (BO->getOpcode())
+    {
+    case Instruction::Add:
+    case Instruction::Mul:
+        for (unsigned pos = 0; pos < 2; ++pos)
+            if (concrete(BO->getOperand(pos)))
+            {
+                Link = {BO->getOpcode(), BO->getOperand(1 - pos), BO->getOperand(pos), false};
+                return true;
+            }
+        return false;
+    case Instruction::Sub:
+        if (!concrete(BO->getOperand(1)))
+            return false;
+        Link = {Instruction::Add, BO->getOperand(0), BO->getOperand(1), true};
+        return true;
+    case Instruction::Shl:
+    {
+        // Uno shift di bw bit o più è poison: non lo si combina
+        unsigned bw = BO->getType()->getScalarSizeInBits();
+        if (!forEachLane(BO->getOperand(1), [bw](const APInt &Lane)
+                         { return Lane.ult(bw); }))
+            return false;
+        Link = {Instruction::Shl, BO->getOperand(0), BO->getOperand(1), false};
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
 /**
  * MULTI-INSTRUCTION OPTIMIZATION
  *
@@ -295,100 +1221,396 @@ bool runOnBasicBlockAdv(BasicBlock &B)
  * uguali. Un esempio:
  *  - a = b+1, c = a-1 => a = b+1, c=b
  *
- * Dapprima avviene un controllo che verifica la validità dell'opcode, che dev'essere un'addizione o una sottrazione.
- * Anche qua è presente 'swp' per controllare che l'operando costante sia in prima o in seconda posizione.
- * Si va poi a iterare su tutti gli usi di quella specifica istruzione e si fa lo stesso controllo, compreso lo swap.
- * Se le posizioni sono le stesse e i due immediates sono uguali, allora l'ultimo controllo da fare riguarda proprio
- * la discordanza di opcode. Infatti, se i due opcode saranno differenti, significa che uno è un'addizione e l'altro
- * una sottrazione. In pratica, si annullano a vicenda!
+ * La versione attuale riassocia intere catene di costanti: il controllo parte dall'istruzione più in basso
+ * (d) e risale all'operando che la definisce; se entrambe sono anelli compatibili (vedi ChainLink) le due
+ * costanti vengono fuse in una sola e d viene ricalcolata direttamente dalla base della catena:
+ *  - (x+C1)+C2 => x+(C1+C2), con le sub trattate come add di -C (a=b+3, c=a+5, d=c-2 => d=b+6);
+ *  - (x*C1)*C2 => x*(C1*C2);
+ *  - (x<<a)<<b => x<<(a+b), oppure 0 se a+b >= bw;
+ *  - (x<<a)*C e (x*C)<<a => x*(C<<a), così x*4*8 diventa x*32 anche dopo che x*4 è stata ridotta a uno shift.
+ * Se la costante risultante è neutra (x+0, x*1) si restituisce direttamente x: il caso (b+k)-k è quindi
+ * un caso particolare della regola generale.
+ *
+ * Le istruzioni vengono estratte dalla worklist in ordine di programma e ogni riscrittura re-inserisce gli user,
+ * quindi una catena lunga n collassa un anello alla volta in n-1 passi. La base x domina l'anello che la usa,
+ * che domina a sua volta l'istruzione corrente: la catena può attraversare più basic block senza controlli
+ * aggiuntivi. Gli anelli intermedi restano in vita solo se hanno altri user, altrimenti vengono cancellati.
+ * I flag nsw/nuw non sono conservati: le nuove istruzioni ricalcolano lo stesso valore in aritmetica modulare.
+ * Due shift vettoriali la cui somma supera bw solo su alcune lane non hanno un unico shift equivalente:
+ * il piano è Missed, con il motivo nella remark.
  */
-bool runOnMultiInstruction(BasicBlock &B)
+static bool matchMultiInstruction(Instruction &I, PlannedRewrite &P)
 {
-    for (auto &I : B)
+    ChainLink Outer, Inner;
+    if (!matchChainLink(&I, Outer) || !matchChainLink(Outer.X, Inner))
+        return false;
+
+    unsigned bw = I.getType()->getScalarSizeInBits();
+    SmallVector<APInt, 4> Lanes;
+    auto all = [&](function_ref<bool(const APInt &)> Pred)
+    { return llvm::all_of(Lanes, Pred); };
+    auto plan = [&](PlannedRewrite::KindTy Kind, unsigned Opcode, const char *Rule)
     {
-        if (Instruction::Add == I.getOpcode() || Instruction::Sub == I.getOpcode())
+        P.Kind = Kind;
+        P.Family = RuleFamily::MultiInstruction;
+        P.Rule = Rule;
+        P.X = Inner.X;
+        P.Opcode = Opcode;
+        P.Lanes = std::move(Lanes);
+        P.Inner = cast<User>(Outer.X);
+        P.InnerSources[0] = P.Inner->getOperand(0);
+        P.InnerSources[1] = P.Inner->getOperand(1);
+        return true;
+    };
+
+    // (x+C1)+C2: somma con segno degli immediati
+    if (Instruction::Add == Outer.Opcode && Instruction::Add == Inner.Opcode)
+    {
+        zipLanes(Inner.K, Outer.K, [&](const APInt &a, const APInt &b)
+                 { return (Inner.Negated ? -a : a) + (Outer.Negated ? -b : b); }, Lanes);
+        if (all([](const APInt &v)
+                { return v.isZero(); }))
+            return plan(PlannedRewrite::Replace, 0, "(x+C1)+C2");
+        return plan(PlannedRewrite::BinOpLanes, Instruction::Add, "(x+C1)+C2");
+    }
+
+    // (x*C1)*C2
+    if (Instruction::Mul == Outer.Opcode && Instruction::Mul == Inner.Opcode)
+    {
+        zipLanes(Inner.K, Outer.K, [](const APInt &a, const APInt &b)
+                 { return a * b; }, Lanes);
+        if (all([](const APInt &v)
+                { return v.isOne(); }))
+            return plan(PlannedRewrite::Replace, 0, "(x*C1)*C2");
+        return plan(PlannedRewrite::BinOpLanes, Instruction::Mul, "(x*C1)*C2");
+    }
+
+    // (x<<a)<<b: la somma va confrontata con bw prima di costruire la costante
+    if (Instruction::Shl == Outer.Opcode && Instruction::Shl == Inner.Opcode)
+    {
+        zipLanes(Inner.K, Outer.K, [](const APInt &a, const APInt &b)
+                 { return a + b; }, Lanes);
+        auto overflows = [bw](const APInt &v)
+        { return v.uge(bw); };
+        if (all(overflows))
         {
-            bool swp = false;
-            ConstantInt *imm1 = nullptr;
+            P.Result = RuleResult::Zero;
+            return plan(PlannedRewrite::Replace, 0, "(x<<a)<<b, a+b >= bw");
+        }
+        // Con solo alcune lane azzerate non esiste un unico shift equivalente
+        if (llvm::any_of(Lanes, overflows))
+            return plan(PlannedRewrite::Missed, 0, "(x<<a)<<b: a+b >= bw solo su alcune lane");
+        return plan(PlannedRewrite::BinOpLanes, Instruction::Shl, "(x<<a)<<b");
+    }
 
-            // Controllo swap della prima istruzione
-            if (ConstantInt *secOp = dyn_cast<ConstantInt>(I.getOperand(1)))
-                imm1 = secOp;
-            else if (ConstantInt *firOp = dyn_cast<ConstantInt>(I.getOperand(0)))
-            {
-                imm1 = firOp;
-                swp = true;
-            }
+    // (x<<a)*C e (x*C)<<a: lo shift diventa parte del moltiplicatore
+    if ((Instruction::Mul == Outer.Opcode && Instruction::Shl == Inner.Opcode) ||
+        (Instruction::Shl == Outer.Opcode && Instruction::Mul == Inner.Opcode))
+    {
+        bool OuterIsMul = Instruction::Mul == Outer.Opcode;
+        Value *C = OuterIsMul ? Outer.K : Inner.K;
+        Value *Sh = OuterIsMul ? Inner.K : Outer.K;
+        zipLanes(C, Sh, [](const APInt &c, const APInt &a)
+                 { return c.shl(a); }, Lanes);
+        return plan(PlannedRewrite::BinOpLanes, Instruction::Mul, OuterIsMul ? "(x<<a)*C" : "(x*C)<<a");
+    }
+    return false;
+}
 
-            if (imm1 != nullptr)
-            {
-                // Itero su tutti gli user della prima istruzione
-                for (auto iter_U = I.user_begin(); iter_U != I.user_end(); ++iter_U)
-                {
-                    Instruction *U = dyn_cast<Instruction>(*iter_U);
-                    if (Instruction::Add == U->getOpcode() || Instruction::Sub == U->getOpcode())
-                    {
-                        ConstantInt *imm2 = nullptr;
-
-                        // Determinato che la seconda istruzione è una add o una sub, ne controllo lo swap
-                        if (ConstantInt *secOp = dyn_cast<ConstantInt>(U->getOperand(1)))
-                            imm2 = secOp;
-                        else if (ConstantInt *firOp = dyn_cast<ConstantInt>(U->getOperand(0)))
-                            imm2 = firOp;
-
-                        if (imm2)
-                        {
-                            // Se lo swap combacia con la prima e gli opcode discordano, abbiamo una multi-instr
-                            if (imm1 == imm2 && I.getOpcode() != U->getOpcode())
-                            {
-                                outs() << "[MultiInstruction]: " << I.getOpcodeName() << " ->" << I << "\n";
-                                outs() << "[MultiInstruction]: " << U->getOpcodeName() << " ->" << I << "\n";
-                                if (swp)
-                                    U->replaceAllUsesWith(I.getOperand(1));
-                                else
-                                    U->replaceAllUsesWith(I.getOperand(0));
-                                outs() << "Multi Instruction trovata" << "\n";
-                            }
-                        }
-                        else
-                            outs() << "Multi Instruction non trovata" << "\n";
-                    }
-                }
-            }
+static void countApplied(RuleFamily Family)
+{
+    switch (Family)
+    {
+    case RuleFamily::AlgebraicIdentity:
+        ++NumAlgebraicIdentity;
+        break;
+    case RuleFamily::MultiInstruction:
+        ++NumMultiInstruction;
+        break;
+    case RuleFamily::StrengthReduction:
+        ++NumStrengthReduction;
+        break;
+    case RuleFamily::DivisionLowering:
+        ++NumDivisionLowering;
+        break;
+    }
+}
+
+static void countMissed(RuleFamily Family)
+{
+    switch (Family)
+    {
+    case RuleFamily::MultiInstruction:
+        ++NumMultiInstructionMissed;
+        break;
+    case RuleFamily::StrengthReduction:
+        ++NumStrengthReductionMissed;
+        break;
+    case RuleFamily::DivisionLowering:
+        ++NumDivisionLoweringMissed;
+        break;
+    case RuleFamily::AlgebraicIdentity:
+        llvm_unreachable("le identità algebriche non producono piani Missed");
+    }
+}
+
+static StringRef getFamilyName(RuleFamily Family)
+{
+    switch (Family)
+    {
+    case RuleFamily::AlgebraicIdentity:
+        return "AlgebraicIdentity";
+    case RuleFamily::MultiInstruction:
+        return "MultiInstruction";
+    case RuleFamily::StrengthReduction:
+        return "StrengthReduction";
+    case RuleFamily::DivisionLowering:
+        return "DivisionLowering";
+    }
+    llvm_unreachable("famiglia di regole sconosciuta");
+}
+
+/**
+ * Applica un piano valido per I, con il Builder posizionato prima di I. Restituisce il valore che
+ * sostituisce I, oppure nullptr se il piano non prevede riscritture (Missed).
+ */
+static Value *applyRewrite(Instruction &I, const PlannedRewrite &P, IRBuilderBase &Builder,
+                           OptimizationRemarkEmitter &ORE)
+{
+    if (P.Kind == PlannedRewrite::Missed)
+    {
+        LLVM_DEBUG(dbgs() << "[" << getFamilyName(P.Family) << "]: non applicata, " << P.Rule << " ->" << I << "\n");
+        ORE.emit([&]()
+                 { return OptimizationRemarkMissed(DEBUG_TYPE, getFamilyName(P.Family), &I)
+                          << "riscrittura non applicata: " << ore::NV("Reason", P.Rule); });
+        countMissed(P.Family);
+        return nullptr;
+    }
+
+    LLVM_DEBUG(dbgs() << "[" << getFamilyName(P.Family) << "]: " << P.Rule << " ->" << I << "\n");
+    emitApplied(ORE, getFamilyName(P.Family), I, P.Rule);
+    countApplied(P.Family);
+
+    Type *Ty = I.getType();
+    Value *x = P.X;
+    switch (P.Kind)
+    {
+    case PlannedRewrite::Replace:
+        return buildResult(P.Result, I, x);
+    case PlannedRewrite::BinOpLanes:
+        return Builder.CreateBinOp((Instruction::BinaryOps)P.Opcode, x, buildLanes(Ty, P.Lanes));
+    case PlannedRewrite::Negate:
+        return Builder.CreateNeg(x);
+    case PlannedRewrite::ShiftAdd:
+        return emitShiftAddSequence(P.Seq, x, Builder);
+    case PlannedRewrite::LaneShiftAdd:
+        return Builder.CreateBinOp((Instruction::BinaryOps)P.Opcode, Builder.CreateShl(x, buildLanes(Ty, P.Lanes)), x);
+    case PlannedRewrite::UDivMagic:
+    {
+        Value *q = createUDivMagic(Builder, x, P);
+        return P.IsRem ? Builder.CreateSub(x, Builder.CreateMul(q, ConstantInt::get(Ty, P.D))) : q;
+    }
+    case PlannedRewrite::SDivPow2:
+    {
+        unsigned bw = P.D.getBitWidth();
+        Value *biased = createSDivPow2(Builder, x, P.Shift);
+        if (P.IsRem)
+        {
+            Value *mask = ConstantInt::get(Ty, APInt::getHighBitsSet(bw, bw - P.Shift));
+            return Builder.CreateSub(x, Builder.CreateAnd(biased, mask));
         }
+        Value *q = Builder.CreateAShr(biased, P.Shift);
+        return P.D.isNegative() ? Builder.CreateNeg(q) : q;
+    }
+    case PlannedRewrite::SDivMagic:
+    {
+        Value *q = createSDivMagic(Builder, x, P);
+        return P.IsRem ? Builder.CreateSub(x, Builder.CreateMul(q, ConstantInt::get(Ty, P.D))) : q;
+    }
+    default:
+        return nullptr;
+    }
+}
+
+// Prova le regole nell'ordine di priorità; legge soltanto l'IR, salvo la cache della funzione
+static PlannedRewrite planRewrite(Instruction &I, ShiftAddCache &SeqCache)
+{
+    PlannedRewrite P;
+    if (!I.isBinaryOp())
+        return P;
+    if (!matchAlgebraicIdentity(I, P) && !matchMultiInstruction(I, P) &&
+        !matchStrengthReduction(I, SeqCache, P) && !matchDivisionLowering(I, P))
+        return PlannedRewrite();
+    P.Sources[0] = I.getOperand(0);
+    P.Sources[1] = I.getOperand(1);
+    return P;
+}
+
+/**
+ * Piano di una funzione, prodotto dalla fase parallela: le istruzioni da visitare in ordine di
+ * programma e, per ciascuna, la riscrittura già decisa (None per quelle banalmente morte).
+ * SeqCache resta alla funzione anche nella fase seriale, così le moltiplicazioni create lì
+ * riusano costi e sequenze già calcolati.
+ */
+struct FunctionPlan
+{
+    SmallVector<Instruction *, 32> Candidates;
+    std::vector<PlannedRewrite> Rewrites;
+    std::unique_ptr<ShiftAddCache> SeqCache;
+};
+
+/**
+ * Pianificazione (fase in sola lettura).
+ *
+ * Ogni istruzione passa da tutte le match*(): se una regola scatta, o se l'istruzione è banalmente
+ * morta, entra tra i candidati insieme al suo piano. Qui si fa tutto il lavoro costoso delle regole
+ * (confronti con la tabella, magic number, ricerca delle sequenze shift/add) senza creare nulla nel
+ * LLVMContext condiviso: per questo può girare in parallelo su funzioni diverse.
+ */
+static void planFunction(Function &F, FunctionPlan &Plan)
+{
+    for (Instruction &I : instructions(F))
+    {
+        PlannedRewrite P;
+        if (!isInstructionTriviallyDead(&I))
+        {
+            P = planRewrite(I, *Plan.SeqCache);
+            if (P.Kind == PlannedRewrite::None)
+                continue;
+        }
+        Plan.Candidates.push_back(&I);
+        Plan.Rewrites.push_back(std::move(P));
     }
-    outs() << "[MultiInstruction] terminata \n\n";
-    return true;
 }
 
-bool runOnFunction(Function &F)
+/**
+ * Motore a punto fisso della funzione.
+ *
+ * La worklist viene inizializzata con i candidati della pianificazione, in ordine di programma.
+ * Per ogni istruzione estratta:
+ *  - se è banalmente morta la si cancella e si re-inseriscono i suoi operandi, che potrebbero
+ *    essere diventati morti a loro volta;
+ *  - altrimenti si usa il suo piano, se c'è ed è ancora valido, oppure la si ripianifica: succede per
+ *    le istruzioni create dalle regole e per quelle rientrate in lista perché è cambiato un operando.
+ *    Se il piano prevede una riscrittura, gli user dell'istruzione vengono re-inseriti (possono aprirsi
+ *    nuove opportunità, ad esempio un'identità esposta dalla strength reduction) e l'istruzione
+ *    originale viene cancellata.
+ * Ogni piano viene consumato alla prima estrazione, quindi non può mai riferirsi a un'istruzione
+ * cancellata. Ogni istruzione rientra in lista solo quando un suo operando cambia, quindi il lavoro
+ * complessivo cresce linearmente con il numero di istruzioni.
+ */
+bool runOnFunction(Function &F, FunctionPlan &Plan, OptimizationRemarkEmitter &ORE)
 {
     bool Transformed = false;
+    LocalOptsWorklist Worklist;
+
+    // Le istruzioni create dalle regole entrano subito in lista
+    IRBuilder<ConstantFolder, IRBuilderCallbackInserter> Builder(
+        F.getContext(), ConstantFolder(),
+        IRBuilderCallbackInserter([&Worklist](Instruction *NewI)
+                                  { Worklist.push(NewI); }));
 
-    for (auto Iter = F.begin(); Iter != F.end(); ++Iter)
+    // Inserimento al contrario: la pop() restituisce le istruzioni in ordine di programma
+    DenseMap<Instruction *, unsigned> Planned;
+    for (unsigned Idx = Plan.Candidates.size(); Idx-- > 0;)
     {
-        if (runOnAlgebraicIdentity(*Iter))
-            Transformed = true;
-        if (runOnBasicBlockAdv(*Iter))
+        Worklist.push(Plan.Candidates[Idx]);
+        Planned[Plan.Candidates[Idx]] = Idx;
+    }
+
+    while (Instruction *I = Worklist.pop())
+    {
+        const PlannedRewrite *P = nullptr;
+        auto It = Planned.find(I);
+        if (It != Planned.end())
         {
-            Transformed = true;
+            P = &Plan.Rewrites[It->second];
+            Planned.erase(It);
         }
-        if (runOnMultiInstruction(*Iter))
+
+        if (isInstructionTriviallyDead(I))
         {
+            for (Value *Op : I->operands())
+                if (Instruction *OpI = dyn_cast<Instruction>(Op))
+                    Worklist.push(OpI);
+            I->eraseFromParent();
+            ++NumDeadErased;
             Transformed = true;
+            continue;
+        }
+
+        PlannedRewrite Fresh;
+        if (!P || !isPlanValid(*I, *P))
+        {
+            Fresh = planRewrite(*I, *Plan.SeqCache);
+            P = &Fresh;
         }
-        /*if (runOnBasicBlock(*Iter)) {
-          Transformed = true;
-        }*/
+        if (P->Kind == PlannedRewrite::None)
+            continue;
+
+        Builder.SetInsertPoint(I);
+        Value *NewV = applyRewrite(*I, *P, Builder, ORE);
+        if (!NewV)
+            continue;
+
+        for (User *U : I->users())
+            Worklist.push(cast<Instruction>(U));
+        if (isa<Instruction>(NewV) && !NewV->hasName())
+            NewV->takeName(I);
+        I->replaceAllUsesWith(NewV);
+
+        // Ora I non ha più user: verrà cancellata alla prossima estrazione
+        Worklist.push(I);
+        Transformed = true;
     }
     return Transformed;
 }
 
+/**
+ * Esecuzione sul modulo in due fasi:
+ *  1. pianificazione, in parallelo sulle funzioni (thread pool di llvm/Support/Parallel.h): per ogni
+ *     istruzione si sceglie la regola e se ne calcolano le costanti (vedi planFunction);
+ *  2. applicazione dei piani, in serie e nell'ordine delle funzioni nel modulo, perché creare
+ *     costanti o inserire istruzioni modifica il LLVMContext condiviso.
+ * Il TargetTransformInfo di ogni funzione viene richiesto prima della fase 1, perché l'analysis
+ * manager non è thread-safe. Il piano di una funzione non dipende da come sono distribuiti i thread,
+ * quindi l'output è identico a quello ottenuto con -localopts-parallel=false.
+ */
 PreservedAnalyses LocalOpts::run(Module &M, ModuleAnalysisManager &AM)
 {
-    for (auto Fiter = M.begin(); Fiter != M.end(); ++Fiter)
-        if (runOnFunction(*Fiter))
-            return PreservedAnalyses::none();
+    FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    SmallVector<Function *, 64> Functions;
+    for (Function &F : M)
+        if (!F.isDeclaration())
+            Functions.push_back(&F);
+
+    std::vector<FunctionPlan> Plans(Functions.size());
+    for (size_t Idx = 0; Idx < Functions.size(); ++Idx)
+        Plans[Idx].SeqCache = std::make_unique<ShiftAddCache>(FAM.getResult<TargetIRAnalysis>(*Functions[Idx]));
+
+    auto plan = [&](size_t Idx)
+    { planFunction(*Functions[Idx], Plans[Idx]); };
+
+    if (ParallelDiscovery)
+        parallelFor(0, Functions.size(), plan);
+    else
+        for (size_t Idx = 0; Idx < Functions.size(); ++Idx)
+            plan(Idx);
+
+    bool Transformed = false;
+    for (size_t Idx = 0; Idx < Functions.size(); ++Idx)
+    {
+        if (Plans[Idx].Candidates.empty())
+            continue;
+        Function &F = *Functions[Idx];
+        if (runOnFunction(F, Plans[Idx], FAM.getResult<OptimizationRemarkEmitterAnalysis>(F)))
+        {
+            // Le analisi a livello di funzione vanno invalidate subito, prima di passare alla successiva
+            FAM.invalidate(F, PreservedAnalyses::none());
+            Transformed = true;
+        }
+    }
 
-    return PreservedAnalyses::all();
-}
\ No newline at end of file
+    return Transformed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
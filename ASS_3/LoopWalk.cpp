@@ -1,14 +1,107 @@
 #include "llvm/Transforms/Utils/LoopWalk.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <cmath>
 
 using namespace llvm;
 
-std::vector<Instruction *> ToMove;
-std::set<Instruction *> Invariants;
+#define DEBUG_TYPE "loopwalk"
+
+STATISTIC(NumHoisted, "Istruzioni spostate nel preheader");
+STATISTIC(NumNotSpeculatable, "Istruzioni scartate perché non speculabili");
+STATISTIC(NumLoadsHoisted, "Load invarianti spostate nel preheader");
+STATISTIC(NumGuarded, "Istruzioni spostate davanti al loop sotto la condizione che le protegge");
+STATISTIC(NumPromoted, "Locazioni di memoria promosse a registro");
+STATISTIC(NumSunk, "Istruzioni spostate nei blocchi di uscita");
+STATISTIC(NumKeptForPressure, "Istruzioni invarianti lasciate nel loop per la pressione sui registri");
+STATISTIC(NumIVReduced, "Espressioni sull'induction variable sostituite da ricorrenze additive");
+STATISTIC(NumUnswitched, "Loop duplicati su una condizione invariante");
+
+static cl::opt<bool> EnableSinking("loopwalk-sink", cl::init(true), cl::Hidden,
+                                   cl::desc("Sposta nelle uscite le istruzioni usate solo dopo il loop"));
+static cl::opt<unsigned> SinkMaxExits("loopwalk-sink-max-exits", cl::init(4), cl::Hidden,
+                                      cl::desc("Numero massimo di uscite in cui duplicare un'istruzione"));
+static cl::opt<bool> EnablePressureModel("loopwalk-reg-pressure", cl::init(true), cl::Hidden,
+                                         cl::desc("Limita gli spostamenti in base alla pressione sui registri"));
+static cl::opt<unsigned> RematCost("loopwalk-remat-cost", cl::init(TargetTransformInfo::TCC_Basic), cl::Hidden,
+                                   cl::desc("Costo massimo di un'istruzione che conviene ricalcolare nel loop "
+                                            "invece di occupare un registro"));
+static cl::opt<unsigned> UnswitchThreshold("loopwalk-unswitch-threshold", cl::init(200), cl::Hidden,
+                                           cl::desc("Numero massimo di istruzioni che l'unswitching può duplicare"));
+
+/**
+ * Stato di una singola invocazione del passo su un nido di loop.
+ * ToMove colleziona, in ordine di scoperta, le istruzioni su cui eseguire la Code Motion,
+ * mentre HoistTarget memorizza per ognuna il loop più esterno da cui può uscire: un operando
+ * è invariante in un loop L se è definito fuori da L o se il suo HoistTarget contiene L.
+ * Guarded contiene le istruzioni che escono sotto guardia, con il blocco del loop da cui
+ * provengono, e GuardBlocks i blocchi di guardia già creati davanti a ogni loop.
+ * MSSAU, presente solo se il loop pass manager mantiene MemorySSA, la tiene aggiornata quando
+ * si spostano accessi in memoria.
+ * Vive solo per la durata di runOnLoopNest(): ogni nido riparte da zero.
+ */
+struct LoopNestState
+{
+    LoopStandardAnalysisResults &LAR;
+    OptimizationRemarkEmitter &ORE;
+    std::unique_ptr<MemorySSAUpdater> MSSAU;
+    SmallVector<Instruction *, 32> ToMove;
+    DenseMap<Instruction *, Loop *> HoistTarget;
+    DenseMap<Instruction *, BasicBlock *> Guarded;
+    DenseMap<std::pair<Loop *, BasicBlock *>, BasicBlock *> GuardBlocks;
+
+    LoopNestState(LoopStandardAnalysisResults &LAR, OptimizationRemarkEmitter &ORE) : LAR(LAR), ORE(ORE)
+    {
+        if (LAR.MSSA)
+            MSSAU = std::make_unique<MemorySSAUpdater>(LAR.MSSA);
+    }
+};
+
+/**
+ * Vista del nido dal punto di vista di un suo loop: le uscite (per il controllo di
+ * dominanza) e SafetyInfo, che dice quali istruzioni vengono eseguite a ogni iterazione.
+ */
+struct LoopWalkState
+{
+    Loop &loop;
+    LoopNestState &Nest;
+    LoopStandardAnalysisResults &LAR;
+    OptimizationRemarkEmitter &ORE;
+    MemorySSAUpdater *MSSAU;
+    SimpleLoopSafetyInfo SafetyInfo;
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+
+    LoopWalkState(Loop &loop, LoopNestState &Nest)
+        : loop(loop), Nest(Nest), LAR(Nest.LAR), ORE(Nest.ORE), MSSAU(Nest.MSSAU.get())
+    {
+        SafetyInfo.computeLoopSafetyInfo(&loop);
+        loop.getExitBlocks(ExitBlocks);
+    }
+};
 
 /**
  * Funzione per il controllo della Loop Invariance di un operando, cioè
@@ -17,142 +110,1307 @@ std::set<Instruction *> Invariants;
  * Controlla che l'operando non sia o una costante o un argomento di funzione, poiché
  * essi saranno sempre Loop Invariant.
  * Nel caso in cui invece l'operando sia il risultato di un'altra istruzione, bisogna
- * accertarsi che tale istruzione non sia all'interno del loop o che sia a sua volta
- * Loop Invariant. Si controlla quindi:
+ * accertarsi che tale istruzione non sia all'interno del loop o che ne esca a sua volta.
+ * Si controlla quindi:
  *  - !loop.contains(inst->getParent())
- *  - Invariants.count(inst)
+ *  - HoistTarget[inst] contiene il loop
  */
-bool isOperandInvariant(Value *operand, Loop &loop)
+bool isOperandInvariant(Value *operand, LoopWalkState &State)
 {
     if (isa<Constant>(operand) || isa<Argument>(operand))
         return true;
     if (Instruction *inst = dyn_cast<Instruction>(operand))
     {
-        if (!loop.contains(inst->getParent()) || Invariants.count(inst))
+        if (!State.loop.contains(inst->getParent()))
+            return true;
+        auto Target = State.Nest.HoistTarget.find(inst);
+        if (Target != State.Nest.HoistTarget.end() && Target->second->contains(&State.loop))
             return true;
     }
 
     return false;
 }
 
+/**
+ * Controlla se un'istruzione del loop può scrivere nella memoria letta da I (una load o
+ * una call readonly).
+ *
+ * Con MemorySSA basta chiedere al walker l'accesso che "clobbera" I: se è fuori dal
+ * loop (o è liveOnEntry) nessuna scrittura nel loop la tocca. Senza MemorySSA si interroga
+ * l'AliasAnalysis su ogni istruzione del loop che scrive in memoria.
+ */
+bool isMemoryClobberedInLoop(Instruction *I, LoopWalkState &State)
+{
+    if (MemorySSA *MSSA = State.LAR.MSSA)
+    {
+        MemoryAccess *Clobber = MSSA->getWalker()->getClobberingMemoryAccess(I);
+        return !MSSA->isLiveOnEntryDef(Clobber) && State.loop.contains(Clobber->getBlock());
+    }
+
+    CallBase *Call = dyn_cast<CallBase>(I);
+    for (BasicBlock *block : State.loop.getBlocks())
+        for (Instruction &W : *block)
+        {
+            if (!W.mayWriteToMemory())
+                continue;
+            if (Call ? isModOrRefSet(State.LAR.AA.getModRefInfo(&W, Call))
+                     : isModSet(State.LAR.AA.getModRefInfo(&W, MemoryLocation::get(I))))
+                return true;
+        }
+    return false;
+}
+
+/**
+ * Istruzioni che non sono speculabili, perché possono trappare o leggono memoria, ma
+ * non hanno effetti collaterali: eseguirle una volta fuori dal loop è corretto se nel
+ * loop sarebbero state eseguite comunque.
+ *  - load semplici (né volatili né atomiche);
+ *  - call readnone/readonly che non lanciano eccezioni, terminano e non sono convergent;
+ *  - divisioni e resti interi, che trappano solo se il divisore è zero.
+ */
+static bool canExecuteOutsideLoop(Instruction *I)
+{
+    if (LoadInst *Load = dyn_cast<LoadInst>(I))
+        return Load->isSimple();
+    if (CallInst *Call = dyn_cast<CallInst>(I))
+        return Call->onlyReadsMemory() && Call->doesNotThrow() && Call->willReturn() && !Call->isConvergent();
+    return isa<BinaryOperator>(I);
+}
+
+/**
+ * Cerca la guardia di un'istruzione che non viene eseguita a ogni iterazione: il branch
+ * condizionale che porta al suo blocco. La guardia è utilizzabile se:
+ *  - il blocco ha come unico predecessore il blocco del branch;
+ *  - il branch viene eseguito a ogni iterazione e la sua condizione è Loop Invariant;
+ *  - le istruzioni che precedono I nel blocco passano sempre il controllo alla successiva.
+ * In questo caso, alla prima iterazione I viene eseguita se e solo se la condizione porta
+ * al suo blocco, e lo stesso test fatto nel preheader ne protegge la copia spostata.
+ */
+static BranchInst *findInvariantGuard(Instruction *I, LoopWalkState &State)
+{
+    BasicBlock *block = I->getParent();
+    BasicBlock *Pred = block->getSinglePredecessor();
+    BranchInst *BI = Pred ? dyn_cast<BranchInst>(Pred->getTerminator()) : nullptr;
+    if (!BI || !BI->isConditional() || BI->getSuccessor(0) == BI->getSuccessor(1) || !State.loop.contains(Pred))
+        return nullptr;
+    if (!isOperandInvariant(BI->getCondition(), State) ||
+        !State.SafetyInfo.isGuaranteedToExecute(*BI, &State.LAR.DT, &State.loop))
+        return nullptr;
+    for (Instruction &Prev : make_range(block->begin(), I->getIterator()))
+        if (!isGuaranteedToTransferExecutionToSuccessor(&Prev))
+            return nullptr;
+    return BI;
+}
+
+/**
+ * Modo in cui un'istruzione Loop Invariant può uscire da un loop:
+ *  - Hoist: viene spostata nel preheader così com'è;
+ *  - GuardedHoist: viene spostata in un blocco davanti al loop eseguito solo se vale la
+ *    condizione invariante che, nel loop, porta al suo blocco.
+ */
+enum HoistKind
+{
+    NoHoist,
+    Hoist,
+    GuardedHoist
+};
+
 /**
  * Funzione per il controllo della Loop Invariance di un'istruzione, cioè
- * se il suo valore cambia durante l'esecuzione del loop.
+ * se il suo valore cambia durante l'esecuzione del loop, e del modo in cui può uscirne.
  *
  * Il primo controllo viene fatto sulla sicurezza (Speculation). In pratica,
- * se ho istruzioni che toccano la memoria, come 'store' o 'call', o lavoro sui
+ * se ho istruzioni che scrivono in memoria, come 'store' o 'call', o lavoro sui
  * thread, non posso spostare tale istruzione al di fuori, poiché potrebbe
- * rompere il programma.
+ * rompere il programma. Le istruzioni senza effetti collaterali ma non speculabili
+ * (canExecuteOutsideLoop) proseguono ai controlli successivi.
  * Successivamente, si esegue un banale controllo con la funzione isOperandInvariant()
  * su tutti gli operandi dell'istruzione. Se tutti gli operandi sono Loop Invariant,
- * anche l'istruzione è da considerasi tale.
+ * anche l'istruzione è da considerasi tale; se legge memoria, nessuna istruzione del
+ * loop deve poterla scrivere.
+ * Infine, per dove spostarla:
+ *  - un'istruzione speculabile esce dal loop da qualunque blocco, anche condizionale;
+ *  - una non speculabile esce se viene eseguita a ogni iterazione, oppure sotto la sua
+ *    guardia (findInvariantGuard).
+ * Le remark vengono emesse solo per il loop più interno (Report): fallire su un loop
+ * esterno vuol dire soltanto che l'istruzione si ferma un livello prima.
  */
-bool isInstrInvariant(Instruction *I, Loop &loop)
+HoistKind getHoistKind(Instruction *I, LoopWalkState &State, bool Report)
 {
-    if (!isSafeToSpeculativelyExecute(I))
+    bool Speculatable = isSafeToSpeculativelyExecute(I);
+    if (!Speculatable && !canExecuteOutsideLoop(I))
     {
-        errs() << "[" << *I << "] Security: Check speculativo negativo!\n";
-        return false;
+        if (!Report)
+            return NoHoist;
+        LLVM_DEBUG(dbgs() << "[" << *I << "] Security: Check speculativo negativo!\n");
+        ++NumNotSpeculatable;
+        State.ORE.emit([&]()
+                       { return OptimizationRemarkMissed(DEBUG_TYPE, "NotSpeculatable", I)
+                                << "istruzione non spostata: non è sicuro eseguirla fuori dal loop"; });
+        return NoHoist;
     }
 
     for (auto operand = I->op_begin(); operand != I->op_end(); ++operand)
     {
-        if (!isOperandInvariant(*operand, loop))
-            return false;
+        if (!isOperandInvariant(*operand, State))
+            return NoHoist;
+    }
+
+    if (I->mayReadFromMemory() && isMemoryClobberedInLoop(I, State))
+    {
+        if (!Report)
+            return NoHoist;
+        LLVM_DEBUG(dbgs() << "[" << *I << "] Lettura non spostabile\n");
+        State.ORE.emit([&]()
+                       { return OptimizationRemarkMissed(DEBUG_TYPE, "LoadNotHoisted", I)
+                                << "lettura non spostata: la memoria letta può essere scritta nel loop"; });
+        return NoHoist;
+    }
+
+    LLVM_DEBUG(dbgs() << "[" << *I << "] Istruzione Loop Invariant!\n");
+
+    if (Speculatable || State.SafetyInfo.isGuaranteedToExecute(*I, &State.LAR.DT, &State.loop))
+        return Hoist;
+    if (findInvariantGuard(I, State))
+        return GuardedHoist;
+
+    if (Report)
+        State.ORE.emit([&]()
+                       { return OptimizationRemarkMissed(DEBUG_TYPE, "NotGuaranteedToExecute", I)
+                                << "istruzione invariante non spostata: non viene eseguita a ogni iterazione "
+                                   "e il suo blocco non dipende da una condizione invariante"; });
+    return NoHoist;
+}
+
+/**
+ * Calcola il loop più esterno da cui l'istruzione può uscire, risalendo dal loop più
+ * interno che la contiene. Ad ogni livello servono un preheader e un HoistKind diverso da
+ * NoHoist; al primo livello che fallisce ci si ferma, perché un'istruzione variante in L lo
+ * è anche in tutti i loop che contengono L. Se al livello scelto serve la guardia, il blocco
+ * dell'istruzione viene registrato in Nest.Guarded.
+ * Gli operandi sono già stati visitati (reverse post-order), quindi il loro HoistTarget
+ * è noto e ogni controllo di invarianza costa O(1) per operando.
+ */
+Loop *findHoistTarget(Instruction &I, LoopNestState &Nest, DenseMap<Loop *, std::unique_ptr<LoopWalkState>> &States)
+{
+    Loop *Innermost = Nest.LAR.LI.getLoopFor(I.getParent());
+    Loop *Target = nullptr;
+    HoistKind Kind = NoHoist;
+    for (Loop *L = Innermost; L && States.count(L); L = L->getParentLoop())
+    {
+        if (!L->getLoopPreheader())
+            break;
+        HoistKind LevelKind = getHoistKind(&I, *States[L], L == Innermost);
+        if (LevelKind == NoHoist)
+            break;
+        Target = L;
+        Kind = LevelKind;
     }
+    if (Kind == GuardedHoist)
+        Nest.Guarded[&I] = I.getParent();
+    return Target;
+}
 
-    outs() << "[" << *I << "] Istruzione Loop Invariant!\n";
+/**
+ * Restituisce il blocco davanti a Target in cui spostare le istruzioni di Guarded, creandolo
+ * se serve. Il preheader viene diviso in due e tra le due metà si inserisce un blocco
+ * eseguito solo se la condizione della guardia porta a Guarded:
+ *
+ *   preheader:  br cond, guard, tail      guard:  ...istruzioni...   br tail
+ *   tail:       PHI [valore, guard], [poison, preheader]   br header
+ *
+ * tail diventa il nuovo preheader del loop. Il valore poison non viene mai usato: nel loop
+ * il blocco Guarded viene eseguito solo quando la condizione vale.
+ * Un blocco già creato per Guarded viene riusato se gli operandi di I sono disponibili al
+ * suo interno (o sono PHI create dalla stessa guardia).
+ */
+static BasicBlock *getOrCreateGuardBlock(Instruction *I, Loop &Target, BasicBlock *Guarded, LoopNestState &Nest)
+{
+    DominatorTree &DT = Nest.LAR.DT;
+    LoopInfo &LI = Nest.LAR.LI;
+    auto Cached = Nest.GuardBlocks.find({&Target, Guarded});
+    if (Cached != Nest.GuardBlocks.end())
+    {
+        BasicBlock *Guard = Cached->second;
+        if (all_of(I->operands(), [&](Value *Op)
+                   {
+                       Instruction *OpI = dyn_cast<Instruction>(Op);
+                       return !OpI || DT.dominates(OpI, Guard->getTerminator()) ||
+                              (isa<PHINode>(OpI) && OpI->getParent() == Guard->getSingleSuccessor()); }))
+            return Guard;
+    }
+
+    BranchInst *BI = cast<BranchInst>(Guarded->getSinglePredecessor()->getTerminator());
+    BasicBlock *preHeader = Target.getLoopPreheader();
+    BasicBlock *Tail = SplitBlock(preHeader, preHeader->getTerminator(), &DT, &LI, Nest.MSSAU.get());
+    BasicBlock *Guard = BasicBlock::Create(preHeader->getContext(), Guarded->getName() + ".guard",
+                                           preHeader->getParent(), Tail);
+    IRBuilder<> Builder(Guard);
+    Builder.CreateBr(Tail);
+    preHeader->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(preHeader);
+    if (BI->getSuccessor(0) == Guarded)
+        Builder.CreateCondBr(BI->getCondition(), Guard, Tail);
+    else
+        Builder.CreateCondBr(BI->getCondition(), Tail, Guard);
+
+    DT.addNewBlock(Guard, preHeader);
+    if (Loop *Parent = Target.getParentLoop())
+        Parent->addBasicBlockToLoop(Guard, LI);
+    if (Nest.MSSAU)
+        Nest.MSSAU->applyInsertUpdates({{DominatorTree::Insert, preHeader, Guard}, {DominatorTree::Insert, Guard, Tail}},
+                                       DT);
+
+    Nest.GuardBlocks[{&Target, Guarded}] = Guard;
+    return Guard;
+}
+
+/**
+ * Completa lo spostamento di I nel blocco Guard: gli operandi che sono PHI della stessa
+ * guardia vengono sostituiti dal valore calcolato in Guard, e gli usi di I passano alla
+ * PHI che, all'uscita della guardia, vale I oppure poison.
+ */
+static void rewriteGuardedUses(Instruction *I, BasicBlock *Guard)
+{
+    BasicBlock *Tail = Guard->getSingleSuccessor();
+    for (Use &Op : I->operands())
+        if (PHINode *Phi = dyn_cast<PHINode>(Op.get()))
+            if (Phi->getParent() == Tail)
+                Op.set(Phi->getIncomingValueForBlock(Guard));
+
+    IRBuilder<> Builder(&Tail->front());
+    PHINode *Phi = Builder.CreatePHI(I->getType(), 2, I->getName() + ".guarded");
+    I->replaceAllUsesWith(Phi);
+    Phi->addIncoming(I, Guard);
+    Phi->addIncoming(PoisonValue::get(I->getType()), Guard->getSinglePredecessor());
+}
+
+/**
+ * MODELLO DI PRESSIONE SUI REGISTRI
+ *
+ * Ogni istruzione spostata nel preheader diventa un valore vivo per tutto il loop. In un
+ * loop già pieno di valori vivi questo provoca spill, e ricaricare il valore dallo stack a
+ * ogni iterazione costa più che ricalcolarlo.
+ *
+ * La pressione di un loop viene stimata, per ogni classe di registri, come:
+ *  - valori definiti fuori dal loop e usati dentro, più le PHI dell'header: sono vivi
+ *    per tutto il loop;
+ *  - più il massimo, su tutti i blocchi, dei valori definiti nel blocco e vivi nello
+ *    stesso punto (un valore definito nel blocco resta vivo fino al suo ultimo uso nel
+ *    blocco, o fino alla fine se è usato altrove).
+ * Le candidate allo spostamento non vengono contate: l'effetto di spostarle lo calcola
+ * applyRegisterPressureModel come variazione netta dei valori vivi.
+ * È una stima per eccesso dei valori definiti in altri blocchi del loop, ma costa un solo
+ * passaggio sul loop ed è sufficiente a riconoscere i loop "larghi".
+ *
+ * La classe di un valore è quella che il TargetTransformInfo assegna al suo tipo (interi,
+ * puntatori, floating point e vettori possono avere banchi diversi). Un confronto usato solo
+ * dal branch del proprio blocco non occupa un registro: il target lo fonde con il salto.
+ */
+static unsigned getRegisterClass(const TargetTransformInfo &TTI, Value *V)
+{
+    return TTI.getRegisterClassForType(V->getType()->isVectorTy(), V->getType());
+}
 
+static bool needsRegister(Value *V)
+{
+    if (V->getType()->isVoidTy() || V->getType()->isLabelTy() || V->getType()->isTokenTy())
+        return false;
+    if (CmpInst *Cmp = dyn_cast<CmpInst>(V))
+        return !(Cmp->hasOneUse() && isa<BranchInst>(Cmp->user_back()) &&
+                 Cmp->user_back()->getParent() == Cmp->getParent());
     return true;
 }
 
+static DenseMap<unsigned, unsigned> estimateRegisterPressure(Loop &loop, const TargetTransformInfo &TTI,
+                                                             const DenseMap<Instruction *, Loop *> &Candidates)
+{
+    DenseMap<unsigned, unsigned> Pressure, LocalPeak;
+    SmallPtrSet<Value *, 32> LiveThrough;
+    for (BasicBlock *block : loop.getBlocks())
+        for (Instruction &I : *block)
+            for (Value *Op : I.operands())
+            {
+                Instruction *OpI = dyn_cast<Instruction>(Op);
+                if (((OpI && !loop.contains(OpI)) || isa<Argument>(Op)) && needsRegister(Op) &&
+                    LiveThrough.insert(Op).second)
+                    ++Pressure[getRegisterClass(TTI, Op)];
+            }
+    for (PHINode &Phi : loop.getHeader()->phis())
+        ++Pressure[getRegisterClass(TTI, &Phi)];
+
+    for (BasicBlock *block : loop.getBlocks())
+    {
+        // Scansione all'indietro: un valore diventa vivo al suo ultimo uso e muore alla definizione
+        DenseMap<unsigned, unsigned> Live;
+        SmallPtrSet<Instruction *, 16> LiveSet;
+        for (Instruction &I : *block)
+            if (needsRegister(&I) && !Candidates.count(&I) && any_of(I.users(), [block](User *U)
+                                                                     { return cast<Instruction>(U)->getParent() != block; }))
+            {
+                LiveSet.insert(&I);
+                ++Live[getRegisterClass(TTI, &I)];
+            }
+
+        for (Instruction &I : reverse(*block))
+        {
+            for (auto &Class : Live)
+                LocalPeak[Class.first] = std::max(LocalPeak[Class.first], Class.second);
+            if (LiveSet.erase(&I))
+                --Live[getRegisterClass(TTI, &I)];
+            if (isa<PHINode>(I))
+                continue;
+            for (Value *Op : I.operands())
+            {
+                Instruction *OpI = dyn_cast<Instruction>(Op);
+                if (OpI && OpI->getParent() == block && !Candidates.count(OpI) && needsRegister(OpI) &&
+                    LiveSet.insert(OpI).second)
+                    ++Live[getRegisterClass(TTI, OpI)];
+            }
+        }
+    }
+
+    for (auto &Class : LocalPeak)
+        Pressure[Class.first] += Class.second;
+    return Pressure;
+}
+
 /**
- * Funzione di popolamento dei vettori ToMove e Invariants.
- * ToMove colleziona tutte le istruzioni per le quali è possibile eseguire
- * la Code Motion, mentre Invariants semplicemente viene usato per il
- * controllo dell'invarianza degli operandi.
+ * Sceglie quali istruzioni di ToMove spostare davvero.
+ *
+ * Le candidate vengono ordinate per costo risparmiato a ogni iterazione (il costo TTI
+ * dell'istruzione) e scelte in modo greedy. Un'istruzione scelta si porta dietro gli operandi
+ * che devono uscire con lei (la sua chiusura), e lo spostamento cambia i valori vivi di ogni
+ * loop attraversato, dal loop che la contiene fino al suo HoistTarget compreso:
+ *  - un valore della chiusura diventa vivo in tutti quei loop solo se ha ancora un user che
+ *    resta dove si trova; se tutti i suoi user escono con lui, vive solo nel preheader;
+ *  - un operando della chiusura i cui user escono tutti smette di essere vivo nel loop, perché
+ *    il suo ultimo uso passa nel preheader (è il caso di %c in "mul %c, 7").
+ * La chiusura è accettata se in ognuno di quei loop la pressione stimata più la variazione netta
+ * resta entro il numero di registri della classe. Superato il budget, si spostano solo le
+ * istruzioni che costano più di -loopwalk-remat-cost; quelle economiche restano nel loop e
+ * vengono ricalcolate a ogni iterazione. Load e call non sono mai considerate economiche:
+ * ripeterle a ogni iterazione costa un accesso in memoria o una chiamata, non un'operazione.
  */
-void findInvariantsInstr(BasicBlock &block, Loop &loop)
+void applyRegisterPressureModel(LoopNestState &Nest)
 {
-    for (auto &I : block)
+    const TargetTransformInfo &TTI = Nest.LAR.TTI;
+    LoopInfo &LI = Nest.LAR.LI;
+    DenseMap<Loop *, DenseMap<unsigned, int>> Pressure;
+    DenseMap<Instruction *, InstructionCost> Cost;
+    for (Instruction *I : Nest.ToMove)
+        Cost[I] = TTI.getInstructionCost(I, TargetTransformInfo::TCK_SizeAndLatency);
+
+    SmallVector<Instruction *, 32> Order(Nest.ToMove.begin(), Nest.ToMove.end());
+    std::stable_sort(Order.begin(), Order.end(), [&](Instruction *A, Instruction *B)
+                     { return Cost[B] < Cost[A]; });
+
+    // Loop in cui un valore spostato resta vivo: da quello che lo contiene al suo HoistTarget
+    auto crossedLoops = [&](Instruction *X, function_ref<void(Loop *)> Fn)
+    {
+        Loop *Target = Nest.HoistTarget[X];
+        for (Loop *L = LI.getLoopFor(X->getParent()); L && L != Target->getParentLoop(); L = L->getParentLoop())
+            Fn(L);
+    };
+
+    SmallPtrSet<Instruction *, 32> Selected;
+    for (Instruction *I : Order)
     {
-        if (isInstrInvariant(&I, loop))
+        if (Selected.count(I))
+            continue;
+
+        // I e gli operandi ancora da scegliere che devono uscire dal loop insieme a lei,
+        // compresa la condizione della guardia per le istruzioni che ne hanno una
+        SmallVector<Instruction *, 8> Closure{I};
+        SmallPtrSet<Instruction *, 8> InClosure{I};
+        SmallVector<Value *, 8> Operands;
+        for (unsigned Idx = 0; Idx < Closure.size(); ++Idx)
+        {
+            SmallVector<Value *, 4> Ops(Closure[Idx]->operands());
+            auto Guard = Nest.Guarded.find(Closure[Idx]);
+            if (Guard != Nest.Guarded.end())
+                Ops.push_back(cast<BranchInst>(Guard->second->getSinglePredecessor()->getTerminator())->getCondition());
+            for (Value *Op : Ops)
+            {
+                Instruction *OpI = dyn_cast<Instruction>(Op);
+                if (OpI && Nest.HoistTarget.count(OpI) && !Selected.count(OpI))
+                {
+                    if (InClosure.insert(OpI).second)
+                        Closure.push_back(OpI);
+                }
+                else if (OpI || isa<Argument>(Op))
+                    Operands.push_back(Op);
+            }
+        }
+
+        auto isMoved = [&](User *U)
         {
-            ToMove.push_back(&I);
-            Invariants.insert(&I);
+            Instruction *UI = dyn_cast<Instruction>(U);
+            return UI && (InClosure.count(UI) || Selected.count(UI));
+        };
+
+        // Variazione netta dei valori vivi, per loop attraversato e classe
+        DenseMap<std::pair<Loop *, unsigned>, int> Delta;
+        SmallPtrSet<Loop *, 4> Crossed;
+        for (Instruction *X : Closure)
+        {
+            crossedLoops(X, [&](Loop *L)
+                         { Crossed.insert(L); });
+            if (needsRegister(X) && !all_of(X->users(), isMoved))
+                crossedLoops(X, [&](Loop *L)
+                             { ++Delta[{L, getRegisterClass(TTI, X)}]; });
         }
+
+        SmallPtrSet<Value *, 8> Freed;
+        for (Value *Op : Operands)
+        {
+            if (!needsRegister(Op) || !all_of(Op->users(), isMoved) || !Freed.insert(Op).second)
+                continue;
+            Instruction *OpI = dyn_cast<Instruction>(Op);
+            for (Loop *L : Crossed)
+            {
+                // Op era contato in L se definito fuori da L, oppure se spostato prima e vivo in L
+                bool Counted = Selected.count(OpI) ? L->contains(OpI) && Nest.HoistTarget[OpI]->contains(L)
+                                                   : !OpI || !L->contains(OpI);
+                if (Counted)
+                    --Delta[{L, getRegisterClass(TTI, Op)}];
+            }
+        }
+
+        bool Fits = true;
+        for (auto &Change : Delta)
+        {
+            Loop *L = Change.first.first;
+            unsigned Class = Change.first.second;
+            if (!Pressure.count(L))
+                for (auto &Base : estimateRegisterPressure(*L, TTI, Nest.HoistTarget))
+                    Pressure[L][Base.first] = Base.second;
+            if (Change.second > 0 && Pressure[L][Class] + Change.second > (int)TTI.getNumberOfRegisters(Class))
+                Fits = false;
+        }
+
+        bool Cheap = !(InstructionCost(RematCost) < Cost[I]) && none_of(Closure, [](Instruction *X)
+                                                                         { return isa<LoadInst>(X) || isa<CallBase>(X); });
+        if (!Fits && Cheap)
+        {
+            LLVM_DEBUG(dbgs() << "[" << *I << "] Lasciata nel loop: pressione sui registri troppo alta\n");
+            continue;
+        }
+
+        for (auto &Change : Delta)
+            Pressure[Change.first.first][Change.first.second] += Change.second;
+        Selected.insert(Closure.begin(), Closure.end());
     }
+
+    for (Instruction *I : Nest.ToMove)
+    {
+        if (Selected.count(I))
+            continue;
+        ++NumKeptForPressure;
+        Nest.ORE.emit([&]()
+                      { return OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure", I)
+                               << "istruzione invariante lasciata nel loop: costa meno ricalcolarla "
+                                  "che tenerla in un registro"; });
+        Nest.HoistTarget.erase(I);
+        Nest.Guarded.erase(I);
+    }
+    erase_if(Nest.ToMove, [&](Instruction *I)
+             { return !Selected.count(I); });
 }
 
 /**
- * Funzione principale che esegue su tutto il loop e verifica la possibilità
- * o meno di eseguire la Code Motion.
+ * PROMOZIONE A REGISTRO
  *
- * Dapprima, viene controllata l'esistenza di un preheader dove poter eseguire
- * la Code Motion. Se non è presente, si ritorna false.
- * Successivamente, si utilizzano alcune strutture dati utili per:
- *  - il DominatorTree (DT).
- *  - vec che contiene tutti i blocchi di uscita del loop.
+ * Una locazione letta e scritta a ogni iterazione (un contatore globale, un accumulatore
+ * passato per puntatore) può vivere in un registro per tutta la durata del loop: la si
+ * legge una volta nel preheader, il valore corrente scorre nelle PHI costruite da
+ * SSAUpdater e lo si scrive una volta in ogni uscita.
  *
- * Si scorre il loop e per ogni blocco si controlla che esso domini tutte
- * le uscite. Se le domina, si passa al controllo della Loop Invariance
- * tramite i metodi precedenti. Sennò, si scarta.
- * Infine, viene eseguita la Code Motion per tutte le istruzioni disponibili.
+ * LoopPromoter specializza LoadAndStorePromoter, che sostituisce le load con il valore
+ * disponibile e cancella load e store originali, aggiungendo le store nelle uscite e
+ * l'aggiornamento di MemorySSA.
+ */
+class LoopPromoter : public LoadAndStorePromoter
+{
+    Value *Ptr;
+    Align Alignment;
+    ArrayRef<BasicBlock *> ExitBlocks;
+    SSAUpdater &SSA;
+    MemorySSAUpdater *MSSAU;
+
+public:
+    LoopPromoter(ArrayRef<const Instruction *> Insts, SSAUpdater &SSA, Value *Ptr, Align Alignment,
+                 ArrayRef<BasicBlock *> ExitBlocks, MemorySSAUpdater *MSSAU)
+        : LoadAndStorePromoter(Insts, SSA), Ptr(Ptr), Alignment(Alignment), ExitBlocks(ExitBlocks),
+          SSA(SSA), MSSAU(MSSAU) {}
+
+    void doExtraRewritesBeforeFinalDeletion() override
+    {
+        for (BasicBlock *Exit : ExitBlocks)
+        {
+            Value *LiveOut = SSA.GetValueInMiddleOfBlock(Exit);
+            IRBuilder<> Builder(Exit, Exit->getFirstInsertionPt());
+            StoreInst *Store = Builder.CreateAlignedStore(LiveOut, Ptr, Alignment);
+            if (MSSAU)
+            {
+                MemoryAccess *Def = MSSAU->createMemoryAccessInBB(Store, nullptr, Exit, MemorySSA::Beginning);
+                MSSAU->insertDef(cast<MemoryDef>(Def), true);
+            }
+        }
+    }
+
+    void instructionDeleted(Instruction *I) const override
+    {
+        if (MSSAU)
+            MSSAU->removeMemoryAccess(I);
+    }
+};
+
+/**
+ * Cerca le locazioni promuovibili e le promuove. Una locazione, identificata dal suo
+ * puntatore, è promuovibile se:
+ *  - il puntatore è definito fuori dal loop;
+ *  - tutti gli accessi sono load/store semplici dello stesso tipo, nei blocchi di L e non
+ *    dei sottoloop;
+ *  - almeno una store viene eseguita a ogni iterazione: la locazione è quindi valida sia
+ *    per la load nel preheader sia per le store nelle uscite;
+ *  - nessun'altra istruzione del loop può leggerla o scriverla, e nessuna può lanciare
+ *    un'eccezione (uscendo senza passare dalle store nelle uscite).
  */
-bool runOnLoop(Loop &loop, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR,
-               LPMUpdater &LU)
+bool promoteLoopScalars(LoopWalkState &State)
 {
+    Loop &loop = State.loop;
     BasicBlock *preHeader = loop.getLoopPreheader();
-    if (!preHeader)
+    // Le promozioni dei sottoloop hanno aggiunto load e store: SafetyInfo va ricalcolata
+    State.SafetyInfo.computeLoopSafetyInfo(&loop);
+    if (!preHeader || !loop.hasDedicatedExits() || State.SafetyInfo.anyBlockMayThrow())
         return false;
 
-    // Strutture dati per uscite/domtree
-    SmallVector<BasicBlock *> vec{};
-    loop.getExitBlocks(vec);
-    DominatorTree &DT = LAR.DT;
+    // Accessi raggruppati per puntatore, nell'ordine in cui compaiono
+    SmallVector<Value *, 8> Pointers;
+    DenseMap<Value *, SmallVector<Instruction *, 4>> Accesses;
+    for (BasicBlock *block : loop.getBlocks())
+    {
+        if (State.LAR.LI.getLoopFor(block) != &loop)
+            continue;
+        for (Instruction &I : *block)
+        {
+            Value *Ptr = getLoadStorePointerOperand(&I);
+            if (!Ptr || !isOperandInvariant(Ptr, State))
+                continue;
+            if (Instruction *PtrI = dyn_cast<Instruction>(Ptr))
+                if (loop.contains(PtrI))
+                    continue;
+            auto &List = Accesses[Ptr];
+            if (List.empty())
+                Pointers.push_back(Ptr);
+            List.push_back(&I);
+        }
+    }
+
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    loop.getUniqueExitBlocks(ExitBlocks);
 
-    // Scorro i BB del Loop
-    auto loopBlocks = loop.getBlocks();
-    for (auto &block : loopBlocks)
+    bool Promoted = false;
+    for (Value *Ptr : Pointers)
     {
-        bool dominateExits = true;
+        SmallVectorImpl<Instruction *> &List = Accesses[Ptr];
+        Type *Ty = getLoadStoreType(List.front());
+        StoreInst *Anchor = nullptr;
+        bool Legal = true;
+        for (Instruction *I : List)
+        {
+            bool Simple = isa<LoadInst>(I) ? cast<LoadInst>(I)->isSimple() : cast<StoreInst>(I)->isSimple();
+            if (!Simple || getLoadStoreType(I) != Ty)
+                Legal = false;
+            StoreInst *Store = dyn_cast<StoreInst>(I);
+            if (!Anchor && Store && State.SafetyInfo.isGuaranteedToExecute(*Store, &State.LAR.DT, &loop))
+                Anchor = Store;
+        }
+        if (!Legal || !Anchor)
+            continue;
 
-        // Controllo che il blocco attuale domini tutte le uscite
-        for (auto exitBB = vec.begin(); exitBB != vec.end(); ++exitBB)
+        // Nessun altro accesso del loop deve toccare la locazione
+        MemoryLocation Loc = MemoryLocation::get(Anchor);
+        SmallPtrSet<Instruction *, 8> Members(List.begin(), List.end());
+        for (BasicBlock *block : loop.getBlocks())
+            for (Instruction &I : *block)
+                if (!Members.count(&I) && I.mayReadOrWriteMemory() &&
+                    isModOrRefSet(State.LAR.AA.getModRefInfo(&I, Loc)))
+                    Legal = false;
+        if (!Legal)
+            continue;
+
+        Align Alignment = Anchor->getAlign();
+        IRBuilder<> Builder(preHeader->getTerminator());
+        LoadInst *Initial = Builder.CreateAlignedLoad(Ty, Ptr, Alignment, Ptr->getName() + ".promoted");
+        if (State.MSSAU)
         {
-            if (!DT.dominates(block, *exitBB))
-                dominateExits = false;
+            MemoryAccess *Use = State.MSSAU->createMemoryAccessInBB(Initial, nullptr, preHeader,
+                                                                    MemorySSA::BeforeTerminator);
+            State.MSSAU->insertUse(cast<MemoryUse>(Use), true);
         }
 
-        // Se non presente, setto un nome univoco al blocco.
-        // Necessario in LLVM per gestione unicità.
-        if (!block->hasName())
-            block->setName("BB");
+        SmallVector<PHINode *, 8> NewPHIs;
+        SSAUpdater SSA(&NewPHIs);
+        SmallVector<const Instruction *, 8> ConstList(List.begin(), List.end());
+        LoopPromoter Promoter(ConstList, SSA, Ptr, Alignment, ExitBlocks, State.MSSAU);
+        SSA.AddAvailableValue(preHeader, Initial);
+        Promoter.run(List);
 
-        outs() << "[" << block->getName() << "] Domina l'uscita?: " << dominateExits << "\n";
+        LLVM_DEBUG(dbgs() << "Locazione promossa a registro: " << *Ptr << "\n");
+        ++NumPromoted;
+        State.ORE.emit([&]()
+                       { return OptimizationRemark(DEBUG_TYPE, "Promoted", Initial)
+                                << "locazione di memoria promossa a registro per tutto il loop"; });
+        Promoted = true;
+    }
 
-        if (dominateExits)
-            findInvariantsInstr(*block, loop);
+    if (Promoted)
+    {
+        // Le store nelle uscite usano valori del loop: vanno ricostruite le PHI LCSSA
+        formLCSSA(loop, State.LAR.DT, &State.LAR.LI, &State.LAR.SE);
+        State.LAR.SE.forgetLoop(&loop);
     }
+    return Promoted;
+}
 
-    // Code Motion
-    for (auto &I : ToMove)
+/**
+ * SINKING NELLE USCITE
+ *
+ * Un'istruzione i cui risultati servono solo dopo il loop viene calcolata a ogni iterazione
+ * ma usata una volta sola: basta calcolarla nel blocco di uscita, sull'ultimo valore dei
+ * suoi operandi. In forma LCSSA gli unici user fuori dal loop sono PHI nei blocchi di uscita,
+ * quindi un'istruzione è candidata se:
+ *  - è pura (speculabile, senza accessi in memoria, non PHI);
+ *  - tutti i suoi user sono PHI LCSSA nelle uscite, con la sola istruzione come valore entrante;
+ *  - le uscite coinvolte sono al più -loopwalk-sink-max-exits: in ognuna viene messa una copia.
+ * Gli operandi definiti nel loop arrivano alla copia attraverso nuove PHI LCSSA. Visitando il
+ * loop dal basso verso l'alto, un operando i cui user sono appena stati spostati diventa a sua
+ * volta candidato, e le catene escono intere.
+ */
+static PHINode *getOrCreateLCSSAPhi(Instruction *Def, BasicBlock *Exit)
+{
+    for (PHINode &Phi : Exit->phis())
+        if (all_of(Phi.incoming_values(), [Def](Value *In)
+                   { return In == Def; }))
+            return &Phi;
+
+    IRBuilder<> Builder(Exit, Exit->begin());
+    PHINode *Phi = Builder.CreatePHI(Def->getType(), 2, Def->getName() + ".lcssa");
+    for (BasicBlock *Pred : predecessors(Exit))
+        Phi->addIncoming(Def, Pred);
+    return Phi;
+}
+
+static bool isSinkable(Instruction &I, LoopWalkState &State, SmallVectorImpl<PHINode *> &ExitPhis)
+{
+    if (isa<PHINode>(I) || I.isTerminator() || I.mayReadOrWriteMemory() || I.use_empty() ||
+        !isSafeToSpeculativelyExecute(&I))
+        return false;
+
+    SmallPtrSet<BasicBlock *, 4> Exits;
+    for (User *U : I.users())
     {
-        outs() << "Istruzione disponibile a CM: " << *I << "\n";
-        I->moveBefore(preHeader->getTerminator());
+        PHINode *Phi = dyn_cast<PHINode>(U);
+        if (!Phi || State.loop.contains(Phi->getParent()) ||
+            !all_of(Phi->incoming_values(), [&I](Value *In)
+                    { return In == &I; }))
+            return false;
+        // Una PHI con più predecessori nel loop compare una volta per ogni valore entrante
+        Exits.insert(Phi->getParent());
+        if (!is_contained(ExitPhis, Phi))
+            ExitPhis.push_back(Phi);
     }
+    return Exits.size() <= SinkMaxExits;
+}
+
+bool sinkToExits(LoopWalkState &State)
+{
+    Loop &loop = State.loop;
+    if (!loop.hasDedicatedExits())
+        return false;
 
-    preHeader->print(outs());
+    LoopBlocksRPO RPO(&loop);
+    RPO.perform(&State.LAR.LI);
 
-    return true;
+    // Dal basso verso l'alto: prima gli user, poi gli operandi
+    SmallVector<BasicBlock *, 16> Blocks(RPO.begin(), RPO.end());
+    bool Sunk = false;
+    for (BasicBlock *block : reverse(Blocks))
+    {
+        if (State.LAR.LI.getLoopFor(block) != &loop)
+            continue;
+
+        for (auto It = block->rbegin(); It != block->rend();)
+        {
+            Instruction &I = *It++;
+            SmallVector<PHINode *, 4> ExitPhis;
+            if (!isSinkable(I, State, ExitPhis))
+                continue;
+
+            // Una copia per uscita: sostituisce la PHI LCSSA di quell'uscita
+            for (PHINode *Phi : ExitPhis)
+            {
+                BasicBlock *Exit = Phi->getParent();
+                Instruction *Copy = I.clone();
+                Copy->insertBefore(&*Exit->getFirstInsertionPt());
+                Copy->setName(I.getName() + ".sunk");
+                for (Use &Op : Copy->operands())
+                    if (Instruction *OpI = dyn_cast<Instruction>(Op.get()))
+                        if (loop.contains(OpI))
+                            Op.set(getOrCreateLCSSAPhi(OpI, Exit));
+
+                State.LAR.SE.forgetValue(Phi);
+                Phi->replaceAllUsesWith(Copy);
+                Phi->eraseFromParent();
+            }
+
+            LLVM_DEBUG(dbgs() << "[" << I << "] Spostata in " << ExitPhis.size() << " uscite\n");
+            ++NumSunk;
+            State.ORE.emit([&]()
+                           { return OptimizationRemark(DEBUG_TYPE, "Sunk", &I)
+                                    << "istruzione usata solo dopo il loop spostata nelle uscite"; });
+            State.LAR.SE.forgetValue(&I);
+            I.eraseFromParent();
+            Sunk = true;
+        }
+    }
+    return Sunk;
+}
+
+/**
+ * Funzione principale che esegue su tutto il nido di loop e verifica la possibilità
+ * o meno di eseguire la Code Motion.
+ *
+ * Il loop pass manager visita prima i loop interni e poi quelli esterni, e trattando
+ * ogni loop separatamente un'istruzione invariante per tutto il nido risalirebbe un
+ * livello per invocazione, riesaminando ogni volta le stesse istruzioni. Il nido viene
+ * quindi processato una volta sola, quando il pass manager arriva al loop più esterno:
+ *  - si scorre il nido in reverse post-order (ogni definizione viene visitata prima dei
+ *    suoi usi) calcolando per ogni istruzione il loop più esterno da cui può uscire;
+ *  - si scartano le istruzioni che, spostate, aumenterebbero troppo la pressione sui
+ *    registri (applyRegisterPressureModel);
+ *  - si esegue la Code Motion, spostando ogni istruzione direttamente nel preheader di
+ *    quel loop, o nel blocco di guardia che la protegge (le letture spostano con sé anche
+ *    il loro accesso in MemorySSA);
+ *  - dal loop più interno al più esterno, si promuovono a registro le locazioni rimaste
+ *    nel loop e si spostano nelle uscite i calcoli usati solo dopo il loop.
+ * Restituisce true solo se il nido è cambiato.
+ */
+bool runOnLoopNest(Loop &Root, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR,
+                   LPMUpdater &LU)
+{
+    // I loop pass non hanno ORE tra le analisi standard: lo si costruisce sulla funzione
+    OptimizationRemarkEmitter ORE(Root.getHeader()->getParent());
+    LoopNestState Nest(LAR, ORE);
+
+    SmallVector<Loop *, 8> Loops = Root.getLoopsInPreorder();
+    DenseMap<Loop *, std::unique_ptr<LoopWalkState>> States;
+    for (Loop *L : Loops)
+        States[L] = std::make_unique<LoopWalkState>(*L, Nest);
+
+    // Scorro i BB del nido
+    LoopBlocksRPO RPO(&Root);
+    RPO.perform(&LAR.LI);
+    for (BasicBlock *block : RPO)
+    {
+        // Le PHI dipendono dal predecessore da cui si arriva e restano sempre nel loop
+        for (Instruction &I : make_range(block->getFirstNonPHI()->getIterator(), block->end()))
+        {
+            if (Loop *Target = findHoistTarget(I, Nest, States))
+            {
+                Nest.ToMove.push_back(&I);
+                Nest.HoistTarget[&I] = Target;
+            }
+        }
+    }
+
+    if (EnablePressureModel)
+        applyRegisterPressureModel(Nest);
+
+    // Code Motion
+    for (Instruction *I : Nest.ToMove)
+    {
+        Loop *Target = Nest.HoistTarget[I];
+        auto Guard = Nest.Guarded.find(I);
+        BasicBlock *Dest = Guard == Nest.Guarded.end() ? Target->getLoopPreheader()
+                                                       : getOrCreateGuardBlock(I, *Target, Guard->second, Nest);
+        LLVM_DEBUG(dbgs() << "Istruzione disponibile a CM: " << *I << " -> " << Dest->getName() << "\n");
+        I->moveBefore(Dest->getTerminator());
+        if (Nest.MSSAU)
+            if (MemoryUseOrDef *Access = LAR.MSSA->getMemoryAccess(I))
+                Nest.MSSAU->moveToPlace(Access, Dest, MemorySSA::BeforeTerminator);
+        if (isa<LoadInst>(I))
+            ++NumLoadsHoisted;
+        // Il valore non cambia, ma SCEV potrebbe averlo classificato rispetto al loop
+        LAR.SE.forgetValue(I);
+        ++NumHoisted;
+        if (Guard == Nest.Guarded.end())
+        {
+            ORE.emit([&]()
+                     { return OptimizationRemark(DEBUG_TYPE, "Hoisted", I)
+                              << "istruzione loop invariant spostata nel preheader"; });
+            continue;
+        }
+
+        rewriteGuardedUses(I, Dest);
+        ++NumGuarded;
+        ORE.emit([&]()
+                 { return OptimizationRemark(DEBUG_TYPE, "HoistedUnderGuard", I)
+                          << "istruzione loop invariant spostata davanti al loop, protetta dalla "
+                             "condizione che la esegue nel loop"; });
+    }
+
+    // Dal basso verso l'alto: le load e store create per un sottoloop possono essere
+    // promosse di nuovo dal loop che lo contiene
+    bool Changed = !Nest.ToMove.empty();
+    for (Loop *L : reverse(Loops))
+    {
+        Changed |= promoteLoopScalars(*States[L]);
+        Changed |= EnableSinking && sinkToExits(*States[L]);
+    }
+    return Changed;
 }
 
 // RUN FUNCTION
 PreservedAnalyses LoopWalk::run(Loop &L, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR,
                                 LPMUpdater &LU)
 {
-    if (!runOnLoop(L, LAM, LAR, LU))
-        return PreservedAnalyses::none();
+    // I loop interni vengono processati insieme al loop più esterno del nido
+    if (L.getParentLoop() || !runOnLoopNest(L, LAM, LAR, LU))
+        return PreservedAnalyses::all();
+
+    // Spostare istruzioni nel preheader non cambia la struttura dei loop: i blocchi di
+    // guardia vengono aggiunti a DT, LI (nel loop padre) e MemorySSA man mano che si
+    // creano, SCEV resta valido e non ci sono loop nuovi o cancellati da segnalare a LU.
+    // MemorySSA viene aggiornata insieme agli accessi spostati o promossi.
+    PreservedAnalyses PA = getLoopPassPreservedAnalyses();
+    if (LAR.MSSA)
+        PA.preserve<MemorySSAAnalysis>();
+    return PA;
+}
+
+/**
+ * STRENGTH REDUCTION SULLE INDUCTION VARIABLE
+ *
+ * Le espressioni del tipo i*c o base+i*stride, con i induction variable del loop, costano una
+ * moltiplicazione per iterazione. SCEV le riconosce come ricorrenze affini {start,+,step}<L>: lo
+ * stesso valore si ottiene con una nuova PHI nell'header, inizializzata a start nel preheader e
+ * incrementata di step nel latch, cioè con una sola add per iterazione.
+ *
+ * start e step vengono materializzati nel preheader con SCEVExpander. Per non creare codice in
+ * altri loop si accettano solo espressioni fatte di costanti e di valori che dominano già il
+ * preheader (niente ricorrenze di loop esterni) e senza divisioni, che potrebbero trappare.
+ */
+static bool isExpandableInPreheader(const SCEV *S, BasicBlock *preHeader, DominatorTree &DT)
+{
+    return !SCEVExprContains(S, [&](const SCEV *Sub)
+                             {
+                                 if (isa<SCEVAddRecExpr>(Sub) || isa<SCEVUDivExpr>(Sub))
+                                     return true;
+                                 if (const SCEVUnknown *U = dyn_cast<SCEVUnknown>(Sub))
+                                     if (Instruction *Def = dyn_cast<Instruction>(U->getValue()))
+                                         return !DT.dominates(Def, preHeader->getTerminator());
+                                 return false; });
+}
+
+/**
+ * Restituisce la ricorrenza affine di L calcolata da V, oppure nullptr se V non lo è o se
+ * start/step non sono espandibili nel preheader.
+ */
+static const SCEVAddRecExpr *getReducibleAddRec(Value *V, Loop &loop, ScalarEvolution &SE, DominatorTree &DT)
+{
+    if (!V->getType()->isIntegerTy() || !SE.isSCEVable(V->getType()))
+        return nullptr;
+
+    const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(V));
+    if (!AR || AR->getLoop() != &loop || !AR->isAffine())
+        return nullptr;
+
+    BasicBlock *preHeader = loop.getLoopPreheader();
+    if (!isExpandableInPreheader(AR->getStart(), preHeader, DT) ||
+        !isExpandableInPreheader(AR->getStepRecurrence(SE), preHeader, DT))
+        return nullptr;
+    return AR;
+}
+
+/**
+ * Funzione principale della strength reduction.
+ *
+ * Le moltiplicazioni candidate sono quelle nei blocchi di L (non dei sottoloop, che hanno la
+ * propria invocazione). Per ogni moltiplicazione si risale la catena degli user finché l'unico
+ * user è una add/sub che resta una ricorrenza affine: in questo modo base+i*stride viene
+ * sostituita per intero e sparisce anche la add. Le candidate vengono visitate dall'ultima
+ * alla prima, così una catena viene sostituita dalla radice e le moltiplicazioni interne,
+ * ormai morte, vengono cancellate invece di generare PHI inutili.
+ *
+ * Recurrences associa a ogni ricorrenza la PHI che la calcola, comprese quelle già presenti
+ * nell'header: espressioni con lo stesso {start,+,step} (a[i*4] e b[i*4]) condividono una PHI.
+ * Una PHI nuova occupa un registro per tutto il loop, quindi viene creata solo se la
+ * moltiplicazione costa (TTI, latenza) più della add che la sostituisce: una moltiplicazione
+ * per potenza di due, che diventa uno shift, resta com'è.
+ */
+static bool runOnIVStrengthReduction(Loop &loop, LoopStandardAnalysisResults &LAR)
+{
+    BasicBlock *preHeader = loop.getLoopPreheader();
+    BasicBlock *header = loop.getHeader();
+    BasicBlock *latch = loop.getLoopLatch();
+    if (!preHeader || !latch || !loop.isLoopSimplifyForm())
+        return false;
+
+    ScalarEvolution &SE = LAR.SE;
+    const TargetTransformInfo &TTI = LAR.TTI;
+    OptimizationRemarkEmitter ORE(header->getParent());
+
+    DenseMap<const SCEV *, PHINode *> Recurrences;
+    for (PHINode &Phi : header->phis())
+        if (SE.isSCEVable(Phi.getType()))
+            if (const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&Phi)))
+                if (AR->getLoop() == &loop)
+                    Recurrences.try_emplace(AR, &Phi);
+
+    SmallVector<WeakTrackingVH, 16> Candidates;
+    for (BasicBlock *block : loop.getBlocks())
+        if (LAR.LI.getLoopFor(block) == &loop)
+            for (Instruction &I : *block)
+                if (Instruction::Mul == I.getOpcode())
+                    Candidates.push_back(&I);
+
+    bool Transformed = false;
+    SCEVExpander Expander(SE, header->getModule()->getDataLayout(), "ivsr");
+    for (auto It = Candidates.rbegin(); It != Candidates.rend(); ++It)
+    {
+        Instruction *Root = dyn_cast_or_null<Instruction>(*It);
+        if (!Root)
+            continue;
+        const SCEVAddRecExpr *AR = getReducibleAddRec(Root, loop, SE, LAR.DT);
+        if (!AR)
+            continue;
+        Instruction *Mul = Root;
+
+        // base+i*stride: la radice è l'ultima add/sub della catena che resta affine
+        while (Root->hasOneUse())
+        {
+            Instruction *User = cast<Instruction>(*Root->user_begin());
+            if ((Instruction::Add != User->getOpcode() && Instruction::Sub != User->getOpcode()) ||
+                LAR.LI.getLoopFor(User->getParent()) != &loop)
+                break;
+            const SCEVAddRecExpr *UserAR = getReducibleAddRec(User, loop, SE, LAR.DT);
+            if (!UserAR)
+                break;
+            Root = User;
+            AR = UserAR;
+        }
+
+        Type *Ty = Root->getType();
+        PHINode *Phi = Recurrences.lookup(AR);
+        if (!Phi)
+        {
+            InstructionCost MulCost = TTI.getInstructionCost(Mul, TargetTransformInfo::TCK_Latency);
+            InstructionCost AddCost = TTI.getArithmeticInstrCost(Instruction::Add, Ty, TargetTransformInfo::TCK_Latency);
+            if (MulCost <= AddCost)
+            {
+                ORE.emit([&]()
+                         { return OptimizationRemarkMissed(DEBUG_TYPE, "IVNotProfitable", Mul)
+                                  << "moltiplicazione non sostituita: non costa più della add della ricorrenza"; });
+                continue;
+            }
+
+            Value *Start = Expander.expandCodeFor(AR->getStart(), Ty, preHeader->getTerminator());
+            Value *Step = Expander.expandCodeFor(AR->getStepRecurrence(SE), Ty, preHeader->getTerminator());
+
+            IRBuilder<> Builder(&header->front());
+            Phi = Builder.CreatePHI(Ty, 2, Root->getName() + ".iv");
+            Builder.SetInsertPoint(latch->getTerminator());
+            Value *Next = Builder.CreateAdd(Phi, Step, Root->getName() + ".iv.next");
+            Phi->addIncoming(Start, preHeader);
+            Phi->addIncoming(Next, latch);
+            Recurrences[AR] = Phi;
+        }
+
+        LLVM_DEBUG(dbgs() << "[" << *Root << "] Sostituita da " << *Phi << "\n");
+        ++NumIVReduced;
+        ORE.emit([&]()
+                 { return OptimizationRemark(DEBUG_TYPE, "IVReduced", Root)
+                          << "espressione sull'induction variable sostituita da una ricorrenza additiva"; });
+
+        SE.forgetValue(Root);
+        Root->replaceAllUsesWith(Phi);
+        RecursivelyDeleteTriviallyDeadInstructions(Root);
+        Transformed = true;
+    }
+    return Transformed;
+}
+
+PreservedAnalyses LoopIVStrengthReduction::run(Loop &L, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR,
+                                               LPMUpdater &LU)
+{
+    if (!runOnIVStrengthReduction(L, LAR))
+        return PreservedAnalyses::all();
+
+    // Il CFG non cambia e non vengono toccati accessi in memoria
+    PreservedAnalyses PA = getLoopPassPreservedAnalyses();
+    if (LAR.MSSA)
+        PA.preserve<MemorySSAAnalysis>();
+    return PA;
+}
+
+/**
+ * UNSWITCHING SU CONDIZIONI INVARIANTI
+ *
+ * Un branch nel loop la cui condizione è Loop Invariant prende sempre la stessa direzione,
+ * ma viene rivalutato a ogni iterazione. Il loop viene duplicato: la condizione viene
+ * testata una volta sola nel vecchio preheader, che salta alla versione in cui il branch va
+ * sempre verso il successore "true" oppure alla copia in cui va sempre verso il "false".
+ * In ogni versione il branch diventa incondizionato e i blocchi rimasti irraggiungibili
+ * vengono cancellati.
+ *
+ * La condizione è invariante se lo è come operando (isOperandInvariant) oppure se è calcolata
+ * nel loop da istruzioni speculabili, che non leggono memoria, con operandi a loro volta
+ * invarianti: queste vengono copiate nel blocco del test (collectInvariantCondition), così
+ * il passo funziona anche senza che LoopWalk le abbia spostate prima.
+ * Vengono gestiti solo i loop più interni e i branch con entrambi i successori nel loop:
+ * togliere un arco interno non cambia la struttura del loop, che resta un loop con lo
+ * stesso header e lo stesso latch.
+ *
+ * Ogni duplicazione raddoppia il codice del loop. Il numero di unswitching già subiti è
+ * salvato nei metadati del loop, e si procede solo se dimensione * 2^volte non supera
+ * -loopwalk-unswitch-threshold. Il DT viene aggiornato solo con gli archi che cambiano
+ * (le uscite raggiunte dalla copia, i branch resi incondizionati e i blocchi cancellati),
+ * senza ricostruirlo per tutta la funzione. Se il loop pass manager mantiene MemorySSA, la
+ * copia riceve i propri accessi con updateForClonedLoop(), gli stessi archi nuovi passano
+ * ad applyInsertUpdates() e gli archi e i blocchi tolti vengono rimossi anche da MemorySSA
+ * prima di cancellarli.
+ */
+static const char *UnswitchCountMD = "llvm.loop.loopwalk.unswitch.count";
+
+/**
+ * Controlla se V può essere calcolato nel blocco del test. Le istruzioni del loop da copiare
+ * vengono aggiunte a Tree, ogni operando prima dei suoi utenti. La profondità è limitata,
+ * così il controllo resta lineare nelle dimensioni della condizione.
+ */
+static bool collectInvariantCondition(Value *V, LoopWalkState &State, SmallVectorImpl<Instruction *> &Tree,
+                                      unsigned Depth = 0)
+{
+    if (isOperandInvariant(V, State))
+        return true;
+    Instruction *I = dyn_cast<Instruction>(V);
+    if (!I || Depth > 8 || isa<PHINode>(I) || I->mayReadFromMemory() || !isSafeToSpeculativelyExecute(I))
+        return false;
+    if (is_contained(Tree, I))
+        return true;
+    for (Value *Op : I->operands())
+        if (!collectInvariantCondition(Op, State, Tree, Depth + 1))
+            return false;
+    Tree.push_back(I);
+    return true;
+}
+
+static BranchInst *findUnswitchCandidate(Loop &loop, LoopWalkState &State, SmallVectorImpl<Instruction *> &Tree)
+{
+    for (BasicBlock *block : loop.getBlocks())
+    {
+        BranchInst *BI = dyn_cast<BranchInst>(block->getTerminator());
+        if (!BI || !BI->isConditional() || isa<Constant>(BI->getCondition()) ||
+            BI->getSuccessor(0) == BI->getSuccessor(1))
+            continue;
+        if (!loop.contains(BI->getSuccessor(0)) || !loop.contains(BI->getSuccessor(1)))
+            continue;
+        Tree.clear();
+        if (collectInvariantCondition(BI->getCondition(), State, Tree))
+            return BI;
+    }
+    return nullptr;
+}
+
+static bool canCloneLoop(Loop &loop, unsigned &Size)
+{
+    Size = 0;
+    for (BasicBlock *block : loop.getBlocks())
+    {
+        if (block->hasAddressTaken() || isa<IndirectBrInst>(block->getTerminator()) ||
+            isa<CallBrInst>(block->getTerminator()))
+            return false;
+        for (Instruction &I : *block)
+        {
+            ++Size;
+            if (CallBase *CB = dyn_cast<CallBase>(&I))
+                if (CB->cannotDuplicate() || CB->isConvergent())
+                    return false;
+            if (I.getType()->isTokenTy() && I.isUsedOutsideOfBlock(block))
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Rende incondizionato il branch di una versione del loop, verso Keep, e cancella la
+ * condizione rimasta inutilizzata e i blocchi della versione che non sono più raggiungibili
+ * dall'header.
+ */
+static void foldUnswitchedBranch(Loop &loop, BranchInst *BI, BasicBlock *Keep, LoopInfo &LI,
+                                 DomTreeUpdater &DTU, MemorySSAUpdater *MSSAU)
+{
+    BasicBlock *block = BI->getParent();
+    BasicBlock *Drop = BI->getSuccessor(0) == Keep ? BI->getSuccessor(1) : BI->getSuccessor(0);
+    if (MSSAU)
+        MSSAU->removeEdge(block, Drop);
+    Drop->removePredecessor(block);
+    Instruction *Cond = dyn_cast<Instruction>(BI->getCondition());
+    IRBuilder<> Builder(BI);
+    Builder.CreateBr(Keep);
+    BI->eraseFromParent();
+    DTU.applyUpdates({{DominatorTree::Delete, block, Drop}});
+    if (Cond && loop.contains(Cond))
+        RecursivelyDeleteTriviallyDeadInstructions(Cond, nullptr, MSSAU);
+
+    SmallPtrSet<BasicBlock *, 16> Reachable;
+    SmallVector<BasicBlock *, 16> Worklist{loop.getHeader()};
+    Reachable.insert(loop.getHeader());
+    while (!Worklist.empty())
+        for (BasicBlock *Succ : successors(Worklist.pop_back_val()))
+            if (loop.contains(Succ) && Reachable.insert(Succ).second)
+                Worklist.push_back(Succ);
+
+    SmallVector<BasicBlock *, 8> Dead;
+    for (BasicBlock *LoopBB : loop.getBlocks())
+        if (!Reachable.count(LoopBB))
+            Dead.push_back(LoopBB);
+    if (MSSAU)
+    {
+        SmallSetVector<BasicBlock *, 8> DeadSet(Dead.begin(), Dead.end());
+        MSSAU->removeBlocks(DeadSet);
+    }
+    for (BasicBlock *DeadBB : Dead)
+        LI.removeBlock(DeadBB);
+    DeleteDeadBlocks(Dead, &DTU);
+}
+
+static bool runOnUnswitch(Loop &loop, LoopStandardAnalysisResults &LAR, LPMUpdater &LU)
+{
+    BasicBlock *preHeader = loop.getLoopPreheader();
+    if (!preHeader || !loop.isInnermost() || !loop.isLoopSimplifyForm())
+        return false;
+
+    OptimizationRemarkEmitter ORE(preHeader->getParent());
+    LoopNestState Nest(LAR, ORE);
+    LoopWalkState State(loop, Nest);
+    SmallVector<Instruction *, 8> Tree;
+    BranchInst *BI = findUnswitchCandidate(loop, State, Tree);
+    if (!BI)
+        return false;
+
+    unsigned Size;
+    auto Count = getOptionalIntLoopAttribute(&loop, UnswitchCountMD);
+    unsigned Done = Count ? *Count : 0;
+    if (!canCloneLoop(loop, Size) || Done >= 16 || (uint64_t(Size) << Done) > UnswitchThreshold)
+    {
+        ORE.emit([&]()
+                 { return OptimizationRemarkMissed(DEBUG_TYPE, "NotUnswitched", BI)
+                          << "condizione invariante non rimossa: loop troppo grande o non duplicabile"; });
+        return false;
+    }
+
+    DominatorTree &DT = LAR.DT;
+    LoopInfo &LI = LAR.LI;
+    MemorySSAUpdater *MSSAU = Nest.MSSAU.get();
+    LAR.SE.forgetTopmostLoop(&loop);
+
+    // Il vecchio preheader diventa il blocco del test, seguito da un nuovo preheader vuoto
+    BasicBlock *TestBB = preHeader;
+    BasicBlock *NewPreHeader = SplitBlock(TestBB, TestBB->getTerminator(), &DT, &LI, MSSAU);
 
-    return PreservedAnalyses::all();
-}
\ No newline at end of file
+    // Ordine dei blocchi del loop originale, usato da MemorySSA per clonarne gli accessi
+    LoopBlocksRPO LBRPO(&loop);
+    LBRPO.perform(&LI);
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> ClonedBlocks;
+    Loop *ClonedLoop = cloneLoopWithPreheader(NewPreHeader, TestBB, &loop, VMap, ".us", &LI, &DT, ClonedBlocks);
+    remapInstructionsInBlocks(ClonedBlocks, VMap);
+
+    // Le uscite ora hanno predecessori in entrambe le versioni: le PHI LCSSA ricevono i valori clonati
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    loop.getUniqueExitBlocks(ExitBlocks);
+    for (BasicBlock *Exit : ExitBlocks)
+        for (PHINode &Phi : Exit->phis())
+            for (unsigned Idx = 0, E = Phi.getNumIncomingValues(); Idx != E; ++Idx)
+                if (loop.contains(Phi.getIncomingBlock(Idx)))
+                {
+                    Value *In = Phi.getIncomingValue(Idx);
+                    Value *ClonedIn = VMap.lookup(In);
+                    Phi.addIncoming(ClonedIn ? ClonedIn : In, cast<BasicBlock>(VMap[Phi.getIncomingBlock(Idx)]));
+                }
+
+    // Una sola valutazione della condizione, congelata se potrebbe essere poison: nel loop
+    // originale il branch poteva non essere mai eseguito
+    // Le istruzioni del loop che calcolano la condizione vengono copiate davanti al test
+    IRBuilder<> Builder(TestBB->getTerminator());
+    ValueToValueMapTy CondMap;
+    for (Instruction *I : Tree)
+    {
+        Instruction *Copy = Builder.Insert(I->clone(), I->getName() + ".inv");
+        RemapInstruction(Copy, CondMap, RF_IgnoreMissingLocals | RF_NoModuleLevelChanges);
+        CondMap[I] = Copy;
+    }
+    Value *Cond = BI->getCondition();
+    if (Value *Copy = CondMap.lookup(Cond))
+        Cond = Copy;
+    if (!isGuaranteedNotToBeUndefOrPoison(Cond, nullptr, TestBB->getTerminator(), &DT))
+        Cond = Builder.CreateFreeze(Cond, Cond->getName() + ".fr");
+    Builder.CreateCondBr(Cond, NewPreHeader, cast<BasicBlock>(VMap[NewPreHeader]));
+    TestBB->getTerminator()->eraseFromParent();
+    LLVM_DEBUG(dbgs() << "Unswitching su " << *Cond << "\n");
+
+    // cloneLoopWithPreheader ha già messo nel DT la copia, appesa al blocco del test: restano
+    // gli archi dalla copia alle uscite, che non sono clonate. Sono archi nuovi anche per
+    // MemorySSA, che vi piazza le PHI dopo aver ricevuto gli accessi della copia
+    SmallVector<Loop::Edge, 4> ExitEdges;
+    loop.getExitEdges(ExitEdges);
+    SmallVector<DominatorTree::UpdateType, 4> Updates;
+    for (const Loop::Edge &Edge : ExitEdges)
+        Updates.push_back({DominatorTree::Insert, cast<BasicBlock>(VMap[Edge.first]), Edge.second});
+    DT.applyUpdates(Updates);
+    if (MSSAU)
+    {
+        MSSAU->updateForClonedLoop(LBRPO, ExitBlocks, VMap, true);
+        MSSAU->applyInsertUpdates(Updates, DT);
+    }
+
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+    BranchInst *ClonedBI = cast<BranchInst>(VMap[BI]);
+    foldUnswitchedBranch(*ClonedLoop, ClonedBI, ClonedBI->getSuccessor(1), LI, DTU, MSSAU);
+    foldUnswitchedBranch(loop, BI, BI->getSuccessor(0), LI, DTU, MSSAU);
+
+    // Le uscite sono condivise dalle due versioni: vanno rese di nuovo dedicate a ciascun loop
+    formDedicatedExitBlocks(&loop, &DT, &LI, MSSAU, true);
+    formDedicatedExitBlocks(ClonedLoop, &DT, &LI, MSSAU, true);
+
+    addStringMetadataToLoop(&loop, UnswitchCountMD, Done + 1);
+    addStringMetadataToLoop(ClonedLoop, UnswitchCountMD, Done + 1);
+
+    ++NumUnswitched;
+    ORE.emit([&]()
+             { return OptimizationRemark(DEBUG_TYPE, "Unswitched", TestBB->getTerminator())
+                      << "loop duplicato su una condizione invariante"; });
+
+    // La copia è un nuovo fratello da visitare, e anche questo loop può avere altre condizioni
+    LU.addSiblingLoops({ClonedLoop});
+    LU.revisitCurrentLoop();
+    return true;
+}
+
+PreservedAnalyses LoopWalkUnswitch::run(Loop &L, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR,
+                                        LPMUpdater &LU)
+{
+    if (!runOnUnswitch(L, LAR, LU))
+        return PreservedAnalyses::all();
+
+    // DT, LI e MemorySSA vengono aggiornati durante la duplicazione, SCEV ha dimenticato il loop
+    PreservedAnalyses PA = getLoopPassPreservedAnalyses();
+    if (LAR.MSSA)
+        PA.preserve<MemorySSAAnalysis>();
+    return PA;
+}
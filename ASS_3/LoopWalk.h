@@ -13,6 +13,20 @@ namespace llvm
                               LoopStandardAnalysisResults &LAR, LPMUpdater &LU);
     };
 
+    class LoopIVStrengthReduction : public PassInfoMixin<LoopIVStrengthReduction>
+    {
+    public:
+        PreservedAnalyses run(Loop &L, LoopAnalysisManager &LAM,
+                              LoopStandardAnalysisResults &LAR, LPMUpdater &LU);
+    };
+
+    class LoopWalkUnswitch : public PassInfoMixin<LoopWalkUnswitch>
+    {
+    public:
+        PreservedAnalyses run(Loop &L, LoopAnalysisManager &LAM,
+                              LoopStandardAnalysisResults &LAR, LPMUpdater &LU);
+    };
+
 } // namespace llvm
 
 #endif
\ No newline at end of file
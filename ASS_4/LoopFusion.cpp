@@ -1,87 +1,142 @@
 #include "llvm/Transforms/Utils/LoopFusion.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/Loads.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/TypedPointerType.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include <functional>
+
+#define DEBUG_TYPE "loopfusion"
+
+STATISTIC(NumAdjacentPairs, "Coppie di loop adiacenti trovate");
+STATISTIC(NumFused, "Coppie di loop fuse");
+STATISTIC(NumNotEquivalent, "Coppie scartate per control flow non equivalente");
+STATISTIC(NumTripCountMismatch, "Coppie scartate per trip count diverso o non calcolabile");
+STATISTIC(NumNegDependencies, "Coppie scartate per dipendenze negative");
+STATISTIC(NumBadShape, "Coppie scartate per forma dei loop non supportata");
+STATISTIC(NumNotMovable, "Coppie scartate per codice tra i loop non spostabile");
+STATISTIC(NumPeeled, "Fusioni con le iterazioni in più staccate in un loop di resto");
+STATISTIC(NumMovedIntervening, "Istruzioni tra due loop spostate prima del primo o dopo il secondo");
+STATISTIC(NumNotProfitable, "Coppie scartate dal modello di convenienza");
+STATISTIC(NumForwarded, "Load sostituite dal valore salvato nella stessa iterazione del loop fuso");
+STATISTIC(NumRotated, "Load sostituite da un buffer rotante di valori delle iterazioni precedenti");
+STATISTIC(NumContracted, "Array temporanei eliminati dopo la fusione");
+STATISTIC(NumDistributed, "Loop distribuiti");
+STATISTIC(NumPartitions, "Loop creati dalla distribuzione");
+
+static llvm::cl::opt<bool> UseForwarding("loopfusion-forward", llvm::cl::init(true), llvm::cl::Hidden,
+                                         llvm::cl::desc("Dopo la fusione inoltra i valori salvati alle load che li "
+                                                        "rileggono ed elimina gli array temporanei"));
+
+static llvm::cl::opt<bool> UseProfitability("loopfusion-profitability", llvm::cl::init(true), llvm::cl::Hidden,
+                                            llvm::cl::desc("Fonde solo le coppie che il modello di cache e "
+                                                           "registri ritiene convenienti"));
 
 // Memorizzazione coppie di loop adiacenti
-void pair(llvm::Loop *&L1, llvm::Loop *&L2, std::set<std::pair<llvm::Loop *, llvm::Loop *>> &set)
+void pair(llvm::Loop *&L1, llvm::Loop *&L2, llvm::SmallVectorImpl<std::pair<llvm::Loop *, llvm::Loop *>> &pairs)
 {
-    set.insert(std::make_pair(L1, L2));
+    pairs.push_back(std::make_pair(L1, L2));
 }
 
-// Trova loop adiacenti
-void adjLoops(std::set<std::pair<llvm::Loop *, llvm::Loop *>> &adjacentLoops, llvm::LoopInfo &LI)
+/**
+ * Trova loop adiacenti, a ogni livello di annidamento.
+ *
+ * Due loop possono essere adiacenti solo se sono fratelli (stesso loop padre, o entrambi
+ * top-level) e il blocco d'uscita del primo porta direttamente al secondo. Invece di
+ * confrontare ogni coppia di loop, si indicizza ogni loop con il blocco da cui si entra:
+ *  - il preheader, per i loop senza guardia;
+ *  - il blocco della guardia, per i loop guarded.
+ * Poi, per ogni loop L1, basta cercare nell'indice il blocco d'uscita (o il suo
+ * successore) per trovare l'unico L2 candidato: il costo è lineare nel numero di loop.
+ * I loop vengono visitati in preorder, con i fratelli nell'ordine del programma, quindi le
+ * coppie escono nell'ordine in cui compaiono nella funzione.
+ */
+void adjLoops(llvm::SmallVectorImpl<std::pair<llvm::Loop *, llvm::Loop *>> &adjacentLoops, llvm::LoopInfo &LI)
 {
     bool adjFound = false;
 
-    for (auto *L1 : LI)
+    llvm::SmallVector<llvm::Loop *, 16> loops = LI.getLoopsInPreorder();
+    llvm::DenseMap<llvm::BasicBlock *, llvm::Loop *> byPreheader, byGuard;
+    for (auto *L : loops)
+    {
+        if (auto *guardBranch = L->getLoopGuardBranch())
+            byGuard[guardBranch->getParent()] = L;
+        else if (auto *preheader = L->getLoopPreheader())
+            byPreheader[preheader] = L;
+    }
+
+    for (auto *L1 : loops)
     {
-        for (auto *L2 : LI)
+        // Blocco d'uscita (spesso con solo 1 istr di branch)
+        auto *exitBlock = L1->getExitBlock();
+        if (!exitBlock)
+            continue;
+
+        llvm::Loop *L2 = nullptr;
+
+        // Caso 1: entrambi guarded
+        if (L1->isGuarded())
         {
-            // Caso 1: entrambi guarded
-            if (L1->isGuarded() && L2->isGuarded())
+            /**
+             * In pratica, si controlla che exitBlock sia vuoto, come vuole
+             * la norma (singola istruzione di branch presente). Inoltre, va
+             * prima verificato che il successore di exitBlock sia proprio la
+             * guardia di L2.
+             *
+             * Se tutto va bene, aggiungiamo una coppia di loop adiacenti come pair.
+             */
+            auto *guard2 = exitBlock->getSingleSuccessor();
+            L2 = guard2 ? byGuard.lookup(guard2) : nullptr;
+            if (L2 && &exitBlock->front() != exitBlock->getTerminator())
             {
-                // Blocco d'uscita (spesso con solo 1 istr di branch)
-                auto *exitBlock = L1->getExitBlock();
-
-                // Usiamo getParent() per ottenere un BasicBlock datatype
-                auto *guard2 = L2->getLoopGuardBranch()->getParent();
-
-                /**
-                 * In pratica, si controlla che exitBlock sia vuoto, come vuole
-                 * la norma (singola istruzione di branch presente). Inoltre, va
-                 * prima verificato che il successore di exitBlock sia proprio la
-                 * guardia di L2.
-                 *
-                 * Se tutto va bene, aggiungiamo una coppia di loop adiacenti come pair.
-                 */
-                if (exitBlock && guard2 && exitBlock->getSingleSuccessor() == guard2)
-                {
-                    bool extraInstr = false;
-                    for (auto &I : *exitBlock)
-                    {
-                        if (&I != exitBlock->getTerminator())
-                        {
-                            llvm::outs() << "[Guarded Loops] Non adiacenti! Istruzione extra → " << I << "\n";
-                            extraInstr = true;
-                            break;
-                        }
-                    }
-                    if (!extraInstr)
-                    {
-                        llvm::outs() << "[Guarded Loops] Adiacenza trovata!\n";
-                        adjFound = true;
-                        pair(L1, L2, adjacentLoops);
-                    }
-                }
+                LLVM_DEBUG(llvm::dbgs() << "[Guarded Loops] Non adiacenti! Istruzione extra → " << exitBlock->front() << "\n");
+                L2 = nullptr;
             }
+        }
 
-            // Caso 2: entrambi unguarded
-            else if (!L1->isGuarded() && !L2->isGuarded())
-            {
-                auto *exitBlock = L1->getExitBlock();
-                auto *preheader2 = L2->getLoopPreheader();
-
-                /**
-                 * In questo caso, il controllo viene fatto semplicemente
-                 * sui due bocchi. Se exitBlock è uguale al preheader del
-                 * successivo, allora sono adiacenti.
-                 */
-                if (exitBlock && preheader2 && exitBlock == preheader2)
-                {
-                    llvm::outs() << "[Unguarded Loops] Adiacenza trovata!\n";
-                    adjFound = true;
-                    pair(L1, L2, adjacentLoops);
-                }
-            }
+        // Caso 2: entrambi unguarded
+        else
+        {
+            /**
+             * In questo caso, il controllo viene fatto semplicemente
+             * sui due bocchi. Se exitBlock è uguale al preheader del
+             * successivo, allora sono adiacenti.
+             */
+            L2 = byPreheader.lookup(exitBlock);
         }
+
+        if (!L2 || L2 == L1 || L2->getParentLoop() != L1->getParentLoop())
+            continue;
+
+        LLVM_DEBUG(llvm::dbgs() << (L1->isGuarded() ? "[Guarded Loops]" : "[Unguarded Loops]")
+                                << " Adiacenza trovata a profondità " << L1->getLoopDepth() << "!\n");
+        ++NumAdjacentPairs;
+        adjFound = true;
+        pair(L1, L2, adjacentLoops);
     }
 
     if (!adjFound)
-        llvm::outs() << "[adjLoops] Nessuna coppia trovata!\n";
+        LLVM_DEBUG(llvm::dbgs() << "[adjLoops] Nessuna coppia trovata!\n");
 }
 
 // Verifica i loop dal punto di vista del control flow
@@ -107,7 +162,7 @@ bool checkEquivalence(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::Dominato
             PDT.dominates(loop.second->getLoopGuardBranch()->getParent(),
                           loop.first->getLoopGuardBranch()->getParent()))
         {
-            llvm::outs() << "\n[checkEquivalence] Control Flow equivalente!\n";
+            LLVM_DEBUG(llvm::dbgs() << "[checkEquivalence] Control Flow equivalente!\n");
             return 1;
         }
     }
@@ -119,15 +174,118 @@ bool checkEquivalence(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::Dominato
     {
         if (DT.dominates(loop.first->getHeader(), loop.second->getHeader()) && PDT.dominates(loop.second->getHeader(), loop.first->getHeader()))
         {
-            llvm::outs() << "\n[checkEquivalence] Control Flow equivalente!\n";
+            LLVM_DEBUG(llvm::dbgs() << "[checkEquivalence] Control Flow equivalente!\n");
             return 1;
         }
     }
     return 0;
 }
 
-// Verifica del trip count
-bool TripCount(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::ScalarEvolution &SE)
+/**
+ * Forma dei loop gestita da loopFusion.
+ *
+ * Ogni loop deve avere preheader, latch, un solo blocco d'uscita e un solo exiting block che
+ * termina con un branch condizionale. I due loop devono avere la stessa forma: test d'uscita
+ * nell'header (non ruotati) o nel latch (ruotati, sempre così se hanno la guardia); il corpo
+ * può avere qualsiasi control flow interno.
+ * Inoltre:
+ *  - nei loop non ruotati l'header di L2 non viene eseguito quando il loop fuso esce, quindi
+ *    i suoi valori, tranne le PHI, non possono essere usati dopo il loop;
+ *  - L2 non può usare valori di L1, nemmeno attraverso PHI LCSSA: nel loop fuso vedrebbe
+ *    quelli dell'iterazione corrente invece di quelli finali.
+ */
+bool checkShape(std::pair<llvm::Loop *, llvm::Loop *> loop)
+{
+    bool rotated = loop.first->getExitingBlock() == loop.first->getLoopLatch();
+    if (loop.first->isGuarded() && !rotated)
+        return 0;
+    for (llvm::Loop *L : {loop.first, loop.second})
+    {
+        if (!L->getLoopPreheader() || !L->getLoopLatch() || !L->getExitBlock() || !L->getExitingBlock() ||
+            L->getExitingBlock() != (rotated ? L->getLoopLatch() : L->getHeader()))
+            return 0;
+        auto *branch = llvm::dyn_cast<llvm::BranchInst>(L->getExitingBlock()->getTerminator());
+        if (!branch || !branch->isConditional())
+            return 0;
+    }
+
+    if (!rotated)
+        for (llvm::Instruction &I : *loop.second->getHeader())
+            if (!llvm::isa<llvm::PHINode>(I) && llvm::any_of(I.users(), [&](llvm::User *U)
+                                                            { return !loop.second->contains(llvm::cast<llvm::Instruction>(U)); }))
+                return 0;
+
+    llvm::SmallVector<llvm::Instruction *, 16> worklist;
+    for (auto *BB : loop.first->getBlocks())
+        for (llvm::Instruction &I : *BB)
+            worklist.push_back(&I);
+    llvm::SmallPtrSet<llvm::Instruction *, 16> seen;
+    while (!worklist.empty())
+    {
+        llvm::Instruction *I = worklist.pop_back_val();
+        if (!seen.insert(I).second)
+            continue;
+        for (llvm::User *U : I->users())
+        {
+            auto *user = llvm::cast<llvm::Instruction>(U);
+            if (loop.second->contains(user))
+                return 0;
+            if (llvm::isa<llvm::PHINode>(user) && !loop.first->contains(user))
+                worklist.push_back(user);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Trip count senza i max resi inutili dalla guardia del loop: smax(c, X) vale X se all'ingresso
+ * del loop è noto che X >= c (es. smax(0, N) diventa N quando la guardia è N > 0).
+ */
+const llvm::SCEV *stripGuardedMax(const llvm::SCEV *S, llvm::Loop *L, llvm::ScalarEvolution &SE)
+{
+    if (auto *add = llvm::dyn_cast<llvm::SCEVAddExpr>(S))
+    {
+        llvm::SmallVector<const llvm::SCEV *, 4> ops;
+        for (auto *op : add->operands())
+            ops.push_back(stripGuardedMax(op, L, SE));
+        return SE.getAddExpr(ops);
+    }
+
+    auto *max = llvm::dyn_cast<llvm::SCEVMinMaxExpr>(S);
+    if (!max || max->getNumOperands() != 2 ||
+        (S->getSCEVType() != llvm::scSMaxExpr && S->getSCEVType() != llvm::scUMaxExpr))
+        return S;
+    bool isSigned = S->getSCEVType() == llvm::scSMaxExpr;
+    auto pred = isSigned ? llvm::ICmpInst::ICMP_SGE : llvm::ICmpInst::ICMP_UGE;
+    for (int k = 0; k < 2; ++k)
+    {
+        auto *bound = max->getOperand(k), *other = max->getOperand(1 - k);
+        if (!llvm::isa<llvm::SCEVConstant>(bound))
+            continue;
+
+        // c' + Y >= c senza overflow equivale a Y >= c - c', più facile da dimostrare con la guardia
+        auto *lhs = other, *rhs = bound;
+        if (auto *add = llvm::dyn_cast<llvm::SCEVAddExpr>(other))
+            if (add->getNumOperands() == 2 && llvm::isa<llvm::SCEVConstant>(add->getOperand(0)) &&
+                (isSigned ? add->hasNoSignedWrap() : add->hasNoUnsignedWrap()))
+            {
+                lhs = add->getOperand(1);
+                rhs = SE.getMinusSCEV(bound, add->getOperand(0));
+            }
+        if (SE.isLoopEntryGuardedByCond(L, pred, lhs, rhs))
+            return stripGuardedMax(other, L, SE);
+    }
+    return S;
+}
+
+/**
+ * Verifica del trip count.
+ *
+ * I due loop devono avere lo stesso numero di backedge, oppure un numero che differisce di
+ * una costante: in peel si restituisce quante iterazioni in più ha L1 (se positivo) o L2
+ * (se negativo). Le iterazioni in più vengono poi staccate da loopFusion in un loop di resto.
+ */
+bool TripCount(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::ScalarEvolution &SE, int64_t &peel)
 {
 
     auto l1Backedges = SE.getBackedgeTakenCount(loop.first);
@@ -140,156 +298,958 @@ bool TripCount(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::ScalarEvolution
     if (l1Backedges->getSCEVType() == llvm::SCEVCouldNotCompute().getSCEVType() ||
         l2Backedges->getSCEVType() == llvm::SCEVCouldNotCompute().getSCEVType())
     {
-        llvm::outs() << "\n[TripCount] Impossibile calcolare il TripCount!\n";
+        LLVM_DEBUG(llvm::dbgs() << "[TripCount] Impossibile calcolare il TripCount!\n");
         return 0;
     }
 
+    peel = 0;
     if (l1Backedges == l2Backedges)
     {
-        llvm::outs() << "\n[TripCount] Stesso numero di backedge\n";
+        LLVM_DEBUG(llvm::dbgs() << "[TripCount] Stesso numero di backedge\n");
         return 1;
     }
-    return 0;
+    if (l1Backedges->getType() != l2Backedges->getType())
+        return 0;
+
+    auto *diff = llvm::dyn_cast<llvm::SCEVConstant>(SE.getMinusSCEV(stripGuardedMax(l1Backedges, loop.first, SE),
+                                                                    stripGuardedMax(l2Backedges, loop.second, SE)));
+    if (!diff || !diff->getAPInt().isSignedIntN(32))
+        return 0;
+
+    peel = diff->getAPInt().getSExtValue();
+    LLVM_DEBUG(llvm::dbgs() << "[TripCount] Backedge diversi di una costante: " << peel << "\n");
+    return 1;
 }
 
-// Controllo delle negative dependecies
-bool negDependencies(std::pair<llvm::Loop *, llvm::Loop *> loop)
+// Vero se S si può materializzare prima di at: costanti e valori che dominano at, niente divisioni
+bool isExpandableAt(const llvm::SCEV *S, llvm::Instruction *at, llvm::DominatorTree &DT)
 {
-    // set con istruzioni dipedenti tra di loro
-    std::set<llvm::Instruction *> depInst{};
+    return !llvm::SCEVExprContains(S, [&](const llvm::SCEV *sub)
+                                   {
+                                       if (llvm::isa<llvm::SCEVAddRecExpr>(sub) || llvm::isa<llvm::SCEVUDivExpr>(sub))
+                                           return true;
+                                       if (auto *unknown = llvm::dyn_cast<llvm::SCEVUnknown>(sub))
+                                           if (auto *def = llvm::dyn_cast<llvm::Instruction>(unknown->getValue()))
+                                               return !DT.dominates(def, at);
+                                       return false; });
+}
 
-    for (auto &BB : loop.first->getBlocks())
-    {
+/**
+ * Verifica che le iterazioni in più del loop più lungo si possano staccare.
+ *
+ * Il loop fuso esegue le iterazioni comuni, poi una copia del loop più lungo (il loop di resto)
+ * riparte da dove si è fermato e completa le sue iterazioni. Serve che:
+ *  - i valori del loop più lungo non siano usati fuori dal loop, perché all'uscita del loop fuso
+ *    non sono ancora quelli finali;
+ *  - l'uscita di L2, dove arriva anche il loop di resto, non abbia PHI;
+ *  - se il più lungo è L1, il trip count di L2 sia calcolabile prima di L1: diventa la nuova
+ *    condizione d'uscita del loop fuso.
+ * Con un resto di L1 le sue ultime iterazioni vengono eseguite dopo tutto L2: è corretto perché
+ * negDependencies accetta solo distanze non negative, cioè nessuna iterazione di L2 tocca
+ * quello che le iterazioni successive di L1 scrivono o leggono.
+ */
+bool canPeel(std::pair<llvm::Loop *, llvm::Loop *> loop, int64_t peel, llvm::ScalarEvolution &SE, llvm::DominatorTree &DT)
+{
+    llvm::Loop *longer = peel > 0 ? loop.first : loop.second;
+    auto *exit = loop.second->getUniqueExitBlock();
+    if (!exit || !exit->phis().empty())
+        return 0;
+
+    for (auto *BB : longer->getBlocks())
         for (llvm::Instruction &I : *BB)
-        {
-            // Se l'istruzione accede alla memoria (tipo a[i]) allora esegui...
-            if (I.getOpcode() == llvm::Instruction::GetElementPtr)
+            for (llvm::User *U : I.users())
+                if (!longer->contains(llvm::cast<llvm::Instruction>(U)))
+                    return 0;
+
+    if (peel > 0)
+    {
+        auto *bound = SE.getMinusSCEV(SE.getBackedgeTakenCount(loop.first),
+                                      SE.getConstant(SE.getBackedgeTakenCount(loop.first)->getType(), peel));
+        return isExpandableAt(bound, loop.first->getLoopPreheader()->getTerminator(), DT);
+    }
+    return 1;
+}
+
+/**
+ * Distanza, in iterazioni, tra l'accesso I1 di L1 e l'accesso I2 di L2 alla stessa cella.
+ *
+ * Se i puntatori sono ricorrenze affini {s1,+,S}<L1> e {s2,+,S}<L2> con lo stesso passo,
+ * I1 all'iterazione a e I2 all'iterazione b toccano la stessa cella quando
+ * s1 + a*S = s2 + b*S, cioè b - a = (s1 - s2) / S. Nel loop fuso l'iterazione i esegue
+ * prima il corpo di L1 e poi quello di L2, quindi l'ordine originale (tutto L1 prima di
+ * tutto L2) è rispettato solo se b >= a: una distanza negativa è una dipendenza all'indietro
+ * che impedisce la fusione.
+ * Restituisce false se la distanza non è calcolabile in modo esatto (passi diversi o non
+ * costanti, differenza tra gli inizi non costante o non multipla del passo, accessi di
+ * dimensione diversa o più grandi del passo, che si sovrappongono solo in parte).
+ */
+bool dependenceDistance(llvm::Instruction *I1, llvm::Instruction *I2, std::pair<llvm::Loop *, llvm::Loop *> loop,
+                        llvm::ScalarEvolution &SE, int64_t &distance)
+{
+    auto *AR1 = llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(llvm::getLoadStorePointerOperand(I1)));
+    auto *AR2 = llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(llvm::getLoadStorePointerOperand(I2)));
+    if (!AR1 || !AR2 || AR1->getLoop() != loop.first || AR2->getLoop() != loop.second ||
+        !AR1->isAffine() || !AR2->isAffine() || AR1->getStepRecurrence(SE) != AR2->getStepRecurrence(SE))
+        return 0;
+
+    auto *step = llvm::dyn_cast<llvm::SCEVConstant>(AR1->getStepRecurrence(SE));
+    auto *diff = llvm::dyn_cast<llvm::SCEVConstant>(SE.getMinusSCEV(AR1->getStart(), AR2->getStart()));
+    if (!step || !diff || step->getAPInt().isZero())
+        return 0;
+
+    const llvm::DataLayout &DL = I1->getModule()->getDataLayout();
+    auto size1 = DL.getTypeStoreSize(llvm::getLoadStoreType(I1));
+    auto size2 = DL.getTypeStoreSize(llvm::getLoadStoreType(I2));
+    int64_t S = step->getAPInt().getSExtValue();
+    int64_t D = diff->getAPInt().getSExtValue();
+    if (size1 != size2 || size1.isScalable() || int64_t(size1.getKnownMinValue()) > std::abs(S) || D % S != 0)
+        return 0;
+
+    distance = D / S;
+    return 1;
+}
+
+/**
+ * Dipendenza tra gli accessi I1 di L1 e I2 di L2 (anche lo stesso loop): nullptr se
+ * DependenceInfo dimostra che non c'è, altrimenti il risultato di DependenceInfo. Per due load
+ * o store semplici si prova anche la distanza esatta con dependenceDistance, che risolve i casi
+ * in cui DependenceInfo non ha livelli o ha direzione sconosciuta; known dice se è riuscita.
+ */
+std::unique_ptr<llvm::Dependence> memoryDependence(llvm::Instruction *I1, llvm::Instruction *I2,
+                                                   std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::DependenceInfo &DI,
+                                                   llvm::ScalarEvolution &SE, bool &known, int64_t &distance)
+{
+    auto simple = [](llvm::Instruction *I)
+    {
+        if (auto *load = llvm::dyn_cast<llvm::LoadInst>(I))
+            return load->isSimple();
+        if (auto *store = llvm::dyn_cast<llvm::StoreInst>(I))
+            return store->isSimple();
+        return false;
+    };
+
+    auto D = DI.depends(I1, I2, true);
+    known = D && simple(I1) && simple(I2) && dependenceDistance(I1, I2, loop, SE, distance);
+    return D;
+}
+
+/**
+ * Controllo delle dipendenze negative tra i due loop.
+ *
+ * Per ogni coppia di accessi in memoria (uno in L1, uno in L2) di cui almeno uno è una
+ * store:
+ *  - se DependenceInfo dimostra che non c'è alcuna dipendenza (oggetti diversi, indici
+ *    disgiunti, ...) la coppia è indipendente;
+ *  - altrimenti si calcola la distanza con SCEV (memoryDependence): la fusione è vietata
+ *    solo da una distanza negativa, o da una distanza che non si sa calcolare.
+ * Istruzioni che accedono alla memoria in modo opaco (call, atomiche, ...) impediscono la
+ * fusione se scrivono, o se leggono e l'altro loop scrive.
+ */
+bool negDependencies(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::DependenceInfo &DI, llvm::ScalarEvolution &SE)
+{
+    // accessi di ogni loop, e se il loop scrive in memoria
+    llvm::SmallVector<llvm::Instruction *, 8> accesses[2];
+    bool writes[2] = {false, false}, opaqueReads[2] = {false, false};
+    llvm::Loop *loops[2] = {loop.first, loop.second};
+
+    for (int k = 0; k < 2; ++k)
+        for (auto *BB : loops[k]->getBlocks())
+            for (llvm::Instruction &I : *BB)
             {
-                // Stiamo parlando di tutti gli usi di %a
-                for (auto &use : I.getOperand(0)->uses())
+                if (!I.mayReadOrWriteMemory())
+                    continue;
+                writes[k] |= I.mayWriteToMemory();
+                bool simple = (llvm::isa<llvm::LoadInst>(I) && llvm::cast<llvm::LoadInst>(I).isSimple()) ||
+                              (llvm::isa<llvm::StoreInst>(I) && llvm::cast<llvm::StoreInst>(I).isSimple());
+                if (simple)
+                    accesses[k].push_back(&I);
+                else if (I.mayWriteToMemory())
                 {
-                    // Controlla che gli user di %a siano istruzioni.
-                    if (auto inst = llvm::dyn_cast<llvm::Instruction>(use.getUser()))
-                    {
-                        if (loop.second->contains(inst))
-                        {
-                            // Indice di %a nel secondo loop.
-                            // Controllo che sia un'istruzione.
-                            if (auto inst2 = llvm::dyn_cast<llvm::Instruction>(inst->getOperand(1)))
-                            {
-                                /**
-                                 * Se è una PHI instruction, significa che il valore non è alterato.
-                                 * Supponiamo a[i]:
-                                 *  - Caso 1: i è quello del preheader (es: i=0)
-                                 *  - Caso 2: i è quello del latch (es: i++)
-                                 * Quindi, siamo davanti a un'istruzione PHI.
-                                 * Se invece l'istruzione non è una PHI (es: i+1), allora qualcos'altro
-                                 * sta alterando l'offset. Questo perché nella forma single SSA vai
-                                 * a ridefinire l'operazione (es: %j = sub %i, 1).
-                                 */
-                                if (auto PHIinst = llvm::dyn_cast<llvm::Instruction>(inst2->getOperand(0)))
-                                {
-                                    switch (PHIinst->getOpcode())
-                                    {
-                                    case llvm::Instruction::PHI:
-                                    case llvm::Instruction::Sub: // se l'istruzione è una sub, l'offset è negativo e si riesce ad unire i loop
-                                        break;
-                                    default:
-                                        depInst.insert(PHIinst); // l'offset verrà modificato da un'altra istruzione --> i loop non possono essere uniti
-                                    }
-                                }
-                            }
-                        }
-                    }
+                    LLVM_DEBUG(llvm::dbgs() << "[negDep] Scrittura opaca, loop non fondibili: " << I << "\n");
+                    return 0;
                 }
+                else
+                    opaqueReads[k] = true;
+            }
+
+    if ((opaqueReads[0] && writes[1]) || (opaqueReads[1] && writes[0]))
+    {
+        LLVM_DEBUG(llvm::dbgs() << "[negDep] Lettura opaca in un loop che l'altro scrive, loop non fondibili\n");
+        return 0;
+    }
+
+    for (auto *I1 : accesses[0])
+        for (auto *I2 : accesses[1])
+        {
+            if (!llvm::isa<llvm::StoreInst>(I1) && !llvm::isa<llvm::StoreInst>(I2))
+                continue;
+            bool known;
+            int64_t distance;
+            if (!memoryDependence(I1, I2, loop, DI, SE, known, distance))
+                continue;
+            if (!known)
+            {
+                LLVM_DEBUG(llvm::dbgs() << "[negDep] Distanza non calcolabile tra " << *I1 << " e " << *I2 << "\n");
+                return 0;
+            }
+            if (distance < 0)
+            {
+                LLVM_DEBUG(llvm::dbgs() << "[negDep] Trovata dipendenza negativa (distanza " << distance << ") tra "
+                                        << *I1 << " e " << *I2 << "\n");
+                return 0;
             }
         }
+    return 1;
+}
+
+/**
+ * Vero se I e J non si possono scambiare di posto: uno dei due accede alla memoria in modo
+ * incompatibile con l'altro (almeno uno scrive e AA non esclude che tocchino la stessa
+ * memoria), oppure uno dei due non si può eseguire a vuoto e l'altro potrebbe non passare il
+ * controllo all'istruzione successiva (eccezione, chiamata che non ritorna, ...).
+ */
+bool conflict(llvm::Instruction *I, llvm::Instruction *J, llvm::AAResults &AA)
+{
+    if ((!llvm::isSafeToSpeculativelyExecute(I) && !llvm::isGuaranteedToTransferExecutionToSuccessor(J)) ||
+        (!llvm::isSafeToSpeculativelyExecute(J) && !llvm::isGuaranteedToTransferExecutionToSuccessor(I)))
+        return 1;
+    if (!I->mayReadOrWriteMemory() || !J->mayReadOrWriteMemory() || (!I->mayWriteToMemory() && !J->mayWriteToMemory()))
+        return 0;
+    return llvm::isModOrRefSet(AA.getModRefInfo(J, llvm::MemoryLocation::getOrNone(I)));
+}
+
+// Vero se I non si può spostare da un lato all'altro del loop L
+bool interferes(llvm::Instruction *I, llvm::Loop *L, llvm::AAResults &AA)
+{
+    for (auto *BB : L->getBlocks())
+        for (llvm::Instruction &M : *BB)
+            if (conflict(I, &M, AA))
+                return 1;
+    return 0;
+}
+
+/**
+ * Codice tra i due loop.
+ *
+ * La fusione cancella i blocchi tra L1 e L2 (l'uscita di L1, che senza guardia è anche il
+ * preheader di L2; con la guardia, il blocco della guardia di L2 e il preheader di L2), quindi
+ * le istruzioni che contengono vanno prima spostate:
+ *  - sopra L1, se i loro operandi sono già disponibili e non interferiscono con L1 né con le
+ *    istruzioni precedenti che restano dopo;
+ *  - altrimenti dopo L2, se nessuno dei loro user è in L2 o tra i due loop e non interferiscono
+ *    con L2 (né con le iterazioni di L1 che finiscono nel loop di resto).
+ * Ogni istruzione mantiene le condizioni in cui viene eseguita: il preheader di L2 finisce nel
+ * preheader di L1 o nell'uscita di L2, il blocco della guardia di L2 (eseguito sempre) nel
+ * blocco della guardia di L1 o nel blocco in cui la guardia di L2 salta il loop.
+ * Le istruzioni usate solo dai terminatori di questi blocchi (la condizione della guardia di L2)
+ * spariscono con loro. In moves si restituisce ogni istruzione con l'istruzione prima della
+ * quale spostarla, nell'ordine in cui vanno spostate; false se qualcosa non si può spostare.
+ */
+bool interveningCode(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::DominatorTree &DT, llvm::AAResults &AA,
+                     int64_t peel, llvm::SmallVectorImpl<std::pair<llvm::Instruction *, llvm::Instruction *>> &moves)
+{
+    llvm::Loop *L1 = loop.first, *L2 = loop.second;
+    auto *preheader2 = L2->getLoopPreheader();
+    auto *exit2 = L2->getUniqueExitBlock();
+
+    // blocchi tra i due loop, con la destinazione sopra L1 e quella dopo L2
+    struct Between
+    {
+        llvm::BasicBlock *BB;
+        llvm::Instruction *hoistTo, *sinkTo;
+    };
+    llvm::SmallVector<Between, 2> between;
+    if (L1->isGuarded())
+    {
+        auto *guard2Branch = L2->getLoopGuardBranch();
+        auto *skip2 = guard2Branch->getSuccessor(guard2Branch->getSuccessor(0) == preheader2 ? 1 : 0);
+        between.push_back({guard2Branch->getParent(), L1->getLoopGuardBranch(), &*skip2->getFirstInsertionPt()});
     }
+    between.push_back({preheader2, L1->getLoopPreheader()->getTerminator(), &*exit2->getFirstInsertionPt()});
 
-    // visualizzazione, se presenti, delle istruzioni che violano la dipendenza negativa
-    if (!depInst.empty())
+    auto isBetween = [&](llvm::BasicBlock *BB)
     {
-        llvm::outs() << "\n\n[negDep] Trovate dipendenze negative! Loop non fondibili:\n";
-        for (auto inst : depInst)
+        return llvm::any_of(between, [BB](const Between &B)
+                            { return B.BB == BB; });
+    };
+
+    // Dall'alto verso il basso: quello che si può portare sopra L1
+    llvm::SmallPtrSet<llvm::Instruction *, 8> hoisted;
+    llvm::SmallVector<std::pair<llvm::Instruction *, llvm::Instruction *>, 8> pending;
+    for (auto &B : between)
+        for (llvm::Instruction &I : *B.BB)
         {
-            llvm::outs() << "Istruzione: " << *inst << "\n";
+            if (I.isTerminator())
+                continue;
+            if (!I.mayHaveSideEffects() && llvm::all_of(I.users(), [&](llvm::User *U)
+                                                        { return llvm::cast<llvm::Instruction>(U)->isTerminator() &&
+                                                                 isBetween(llvm::cast<llvm::Instruction>(U)->getParent()); }))
+                continue;
+            // PHI LCSSA di L1: loopFusion le sostituisce con il loro valore
+            if (auto *phi = llvm::dyn_cast<llvm::PHINode>(&I))
+                if (phi->getNumIncomingValues() == 1 && L1->contains(phi->getIncomingBlock(0)))
+                    continue;
+            if (llvm::isa<llvm::PHINode>(I) || I.isEHPad())
+            {
+                LLVM_DEBUG(llvm::dbgs() << "[interveningCode] Istruzione non spostabile: " << I << "\n");
+                return 0;
+            }
+
+            bool canHoist = !interferes(&I, L1, AA) &&
+                            llvm::all_of(I.operands(), [&](llvm::Value *op)
+                                         {
+                                             auto *def = llvm::dyn_cast<llvm::Instruction>(op);
+                                             return !def || hoisted.count(def) || DT.dominates(def, B.hoistTo); }) &&
+                            llvm::none_of(pending, [&](std::pair<llvm::Instruction *, llvm::Instruction *> &P)
+                                          { return conflict(&I, P.first, AA); });
+            if (canHoist)
+            {
+                hoisted.insert(&I);
+                moves.push_back({&I, B.hoistTo});
+            }
+            else
+                pending.push_back({&I, B.sinkTo});
         }
-        return 0;
+
+    // Dal basso verso l'alto: il resto va dopo L2
+    llvm::DenseMap<llvm::Instruction *, llvm::Instruction *> sunk;
+    for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+    {
+        llvm::Instruction *I = it->first, *to = it->second;
+        for (llvm::Use &U : I->uses())
+        {
+            auto *user = llvm::cast<llvm::Instruction>(U.getUser());
+            if (sunk.lookup(user) == to)
+                continue;
+            auto *useBB = user->getParent();
+            if (auto *phi = llvm::dyn_cast<llvm::PHINode>(user))
+                useBB = phi->getIncomingBlock(U);
+            if (isBetween(user->getParent()) || L1->contains(user) || L2->contains(user) ||
+                sunk.count(user) || !DT.dominates(to->getParent(), useBB))
+            {
+                LLVM_DEBUG(llvm::dbgs() << "[interveningCode] Istruzione non spostabile: " << *I << "\n");
+                return 0;
+            }
+        }
+        if (interferes(I, L2, AA) || (peel > 0 && interferes(I, L1, AA)) ||
+            llvm::any_of(sunk, [&](std::pair<llvm::Instruction *, llvm::Instruction *> S)
+                         { return S.second != to && conflict(I, S.first, AA); }))
+        {
+            LLVM_DEBUG(llvm::dbgs() << "[interveningCode] Istruzione non spostabile: " << *I << "\n");
+            return 0;
+        }
+        sunk[I] = to;
     }
+    moves.append(pending.begin(), pending.end());
     return 1;
 }
 
-// Fusione dei loop
-void loopFusion(llvm::Loop *&L1, llvm::Loop *&L2)
+// Accessi in memoria e valori vivi di un loop, per il modello di convenienza
+struct LoopFootprint
+{
+    llvm::SmallVector<llvm::Instruction *, 8> accesses;
+    // flussi di accessi affini, (base, passo) -> byte nuovi a ogni iterazione
+    llvm::DenseMap<std::pair<const llvm::SCEV *, const llvm::SCEV *>, uint64_t> streams;
+    // accessi non affini: ognuno porta una linea di cache nuova a ogni iterazione
+    unsigned irregular = 0;
+    // valori vivi per tutto il loop: invarianti usati nel loop e PHI dell'header
+    llvm::SmallPtrSet<llvm::Value *, 16> live;
+};
+
+// Flusso di un accesso affine: base del puntatore e passo costante, oppure nullptr
+std::pair<const llvm::SCEV *, const llvm::SCEV *> streamOf(llvm::Instruction *I, llvm::ScalarEvolution &SE)
 {
+    auto *AR = llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(llvm::getLoadStorePointerOperand(I)));
+    if (!AR || !AR->isAffine() || !llvm::isa<llvm::SCEVConstant>(AR->getStepRecurrence(SE)))
+        return {nullptr, nullptr};
+    return {SE.getPointerBase(AR), AR->getStepRecurrence(SE)};
+}
+
+LoopFootprint footprint(llvm::Loop *L, llvm::ScalarEvolution &SE, unsigned lineSize)
+{
+    LoopFootprint fp;
+    for (auto *BB : L->getBlocks())
+        for (llvm::Instruction &I : *BB)
+        {
+            for (llvm::Value *op : I.operands())
+            {
+                auto *def = llvm::dyn_cast<llvm::Instruction>(op);
+                if ((def && !L->contains(def)) || llvm::isa<llvm::Argument>(op))
+                    fp.live.insert(op);
+            }
+            if (!llvm::isa<llvm::LoadInst>(I) && !llvm::isa<llvm::StoreInst>(I))
+                continue;
+
+            fp.accesses.push_back(&I);
+            if (SE.isLoopInvariant(SE.getSCEV(llvm::getLoadStorePointerOperand(&I)), L))
+                continue;
+            auto stream = streamOf(&I, SE);
+            if (!stream.first)
+            {
+                ++fp.irregular;
+                continue;
+            }
+            uint64_t bytes = llvm::cast<llvm::SCEVConstant>(stream.second)->getAPInt().abs().getLimitedValue(lineSize);
+            fp.streams[stream] = std::max(fp.streams[stream], bytes);
+        }
+    for (llvm::PHINode &phi : L->getHeader()->phis())
+        fp.live.insert(&phi);
+    return fp;
+}
+
+// Registri in più di quelli disponibili, per classe, per tenere vivi i valori in live
+llvm::DenseMap<unsigned, unsigned> registerExcess(const llvm::SmallPtrSetImpl<llvm::Value *> &live, const llvm::TargetTransformInfo &TTI)
+{
+    llvm::DenseMap<unsigned, unsigned> pressure, excess;
+    for (llvm::Value *V : live)
+        ++pressure[TTI.getRegisterClassForType(V->getType()->isVectorTy(), V->getType())];
+    for (auto &cls : pressure)
+        if (cls.second > TTI.getNumberOfRegisters(cls.first))
+            excess[cls.first] = cls.second - TTI.getNumberOfRegisters(cls.first);
+    return excess;
+}
+
+/**
+ * Modello di convenienza della fusione.
+ *
+ * Tutto è stimato in byte di traffico verso la memoria per iterazione del loop fuso:
+ *  - guadagno: un flusso (stessa base, stesso passo) usato dai due loop a distanza costante di d
+ *    iterazioni viene riletto da L2 in cache, se le d+1 iterazioni che separano i due accessi ci
+ *    stanno (footprint per iterazione del loop fuso per d+1 non oltre la cache L1). Non c'è
+ *    guadagno se L1 intero sta già in cache (trip count costante): L2 ritroverebbe i dati anche
+ *    senza fusione;
+ *  - costo dei registri: ogni valore vivo per tutto il loop (invarianti, PHI) che nel loop fuso
+ *    non sta più nei registri, e ci stava nei loop separati, costa una store e una load per
+ *    iterazione;
+ *  - costo della cache: ogni flusso oltre l'associatività della cache L1, che nei loop separati
+ *    non c'era, ruba le linee agli altri: una linea ricaricata per iterazione.
+ * La fusione conviene se il guadagno non è minore dei costi (a parità si risparmia comunque il
+ * controllo di un loop). Cache e linee vengono da TTI, con 32 KiB, linee da 64 byte e 8 vie se
+ * il target non le fornisce. Se la fusione non conviene, in reason si spiega il perché.
+ */
+bool profitable(std::pair<llvm::Loop *, llvm::Loop *> loop, llvm::ScalarEvolution &SE, const llvm::TargetTransformInfo &TTI,
+                std::string &reason)
+{
+    auto cacheSize = TTI.getCacheSize(llvm::TargetTransformInfo::CacheLevel::L1D);
+    auto cacheWays = TTI.getCacheAssociativity(llvm::TargetTransformInfo::CacheLevel::L1D);
+    uint64_t cache = cacheSize ? *cacheSize : 32 * 1024;
+    uint64_t ways = cacheWays ? *cacheWays : 8;
+    unsigned lineSize = TTI.getCacheLineSize() ? TTI.getCacheLineSize() : 64;
+
+    LoopFootprint fp1 = footprint(loop.first, SE, lineSize);
+    LoopFootprint fp2 = footprint(loop.second, SE, lineSize);
+
+    // Loop fuso: unione dei flussi e dei valori vivi (le IV affini di L2 diventano espressioni di quelle di L1)
+    auto fused = fp1.streams;
+    for (auto &stream : fp2.streams)
+        fused[stream.first] = std::max(fused[stream.first], stream.second);
+    llvm::SmallPtrSet<llvm::Value *, 16> fusedLive(fp1.live.begin(), fp1.live.end());
+    fusedLive.insert(fp2.live.begin(), fp2.live.end());
+    for (llvm::PHINode &phi : loop.second->getHeader()->phis())
+        if (SE.isSCEVable(phi.getType()))
+            if (auto *AR = llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(&phi)))
+                if (AR->isAffine())
+                    fusedLive.erase(&phi);
+
+    auto bytes = [lineSize](const llvm::DenseMap<std::pair<const llvm::SCEV *, const llvm::SCEV *>, uint64_t> &streams,
+                            unsigned irregular)
+    {
+        uint64_t total = uint64_t(irregular) * lineSize;
+        for (auto &stream : streams)
+            total += stream.second;
+        return total;
+    };
+    uint64_t bytes1 = bytes(fp1.streams, fp1.irregular);
+    uint64_t bytesFused = bytes(fused, fp1.irregular + fp2.irregular);
+
+    // Guadagno: flussi condivisi, con la distanza minima tra gli accessi dei due loop
+    llvm::DenseMap<std::pair<const llvm::SCEV *, const llvm::SCEV *>, uint64_t> shared;
+    for (auto *I1 : fp1.accesses)
+        for (auto *I2 : fp2.accesses)
+        {
+            int64_t distance;
+            if (!dependenceDistance(I1, I2, loop, SE, distance))
+                continue;
+            auto stream = streamOf(I1, SE);
+            auto it = shared.find(stream);
+            if (it == shared.end() || uint64_t(std::abs(distance)) < it->second)
+                shared[stream] = std::abs(distance);
+        }
+    unsigned tripCount = SE.getSmallConstantTripCount(loop.first);
+    bool cachedAnyway = tripCount && tripCount * bytes1 <= cache;
+    uint64_t gain = 0;
+    if (!cachedAnyway)
+        for (auto &stream : shared)
+            if ((stream.second + 1) * bytesFused <= cache)
+                gain += fp2.streams.lookup(stream.first);
+
+    // Costo dei registri
+    auto excess1 = registerExcess(fp1.live, TTI), excess2 = registerExcess(fp2.live, TTI);
+    uint64_t spills = 0;
+    for (auto &cls : registerExcess(fusedLive, TTI))
+        if (cls.second > excess1.lookup(cls.first) + excess2.lookup(cls.first))
+            spills += cls.second - excess1.lookup(cls.first) - excess2.lookup(cls.first);
+    uint64_t spillCost = spills * 2 * loop.first->getHeader()->getModule()->getDataLayout().getPointerSize();
+
+    // Costo della cache
+    auto over = [ways](uint64_t streams)
+    { return streams > ways ? streams - ways : 0; };
+    uint64_t conflicts = over(fused.size() + fp1.irregular + fp2.irregular);
+    uint64_t separate = over(fp1.streams.size() + fp1.irregular) + over(fp2.streams.size() + fp2.irregular);
+    uint64_t conflictCost = conflicts > separate ? (conflicts - separate) * lineSize : 0;
+
+    LLVM_DEBUG(llvm::dbgs() << "[profitable] Riuso " << gain << " byte/iterazione, registri " << spillCost
+                            << ", conflitti in cache " << conflictCost << "\n");
+    if (gain >= spillCost + conflictCost)
+        return 1;
+
+    llvm::raw_string_ostream(reason) << "fusione non conveniente: riuso in cache di " << gain
+                                     << " byte/iterazione, contro " << spillCost << " byte/iterazione di spill e "
+                                     << conflictCost << " byte/iterazione di conflitti in cache";
+    return 0;
+}
+
+/**
+ * Fusione dei loop
+ *
+ * Il corpo di L2 viene eseguito dopo quello di L1 nella stessa iterazione, senza assumere
+ * niente sulla forma interna dei due corpi: si spostano solo gli archi tra header e latch.
+ *  - Loop non ruotati (test d'uscita nell'header): l'header di L1 esce dove usciva L2, il
+ *    latch di L1 porta all'header di L2, il cui test diventa un salto incondizionato, e il
+ *    latch di L2 torna all'header di L1.
+ *  - Loop ruotati (test nel latch, anche con un solo blocco): il latch di L1 salta sempre
+ *    all'header di L2, e il latch di L2 torna all'header di L1 con il test del loop più corto.
+ *    Con la guardia, la guardia di L1 salta direttamente dove saltava quella di L2.
+ * Le PHI dell'header di L2 che SCEV vede come ricorrenze affini {a,+,s} vengono riscritte con
+ * SCEVExpander come {a,+,s} su L1, cioè in funzione delle IV di L1; le altre (riduzioni, ...)
+ * passano nell'header di L1. Le PHI LCSSA all'uscita di L1 vengono sostituite dal loro valore.
+ *
+ * Oltre a modificare il CFG, aggiorna le analisi che servono alle fusioni successive:
+ *  - DT e PDT, con gli archi aggiunti e rimossi (confrontando i successori di ogni blocco
+ *    toccato prima e dopo le modifiche) e i blocchi rimasti irraggiungibili, che vengono
+ *    cancellati;
+ *  - LoopInfo: i blocchi e i sottoloop rimasti di L2 passano a L1, e L2 viene cancellato;
+ *  - SCEV, che dimentica quanto sapeva dei due loop.
+ * Se i trip count differiscono di peel iterazioni (vedi TripCount), prima della fusione il
+ * loop più lungo viene clonato in un loop di resto, eseguito all'uscita del loop fuso: in
+ * questo caso DT e PDT vengono ricalcolati.
+ */
+void loopFusion(llvm::Loop *&L1, llvm::Loop *&L2, llvm::LoopInfo &LI, llvm::DominatorTree &DT,
+                llvm::PostDominatorTree &PDT, llvm::ScalarEvolution &SE, int64_t peel)
+{
+    bool guarded = L1->isGuarded();
+    llvm::BasicBlock *guard1 = guarded ? L1->getLoopGuardBranch()->getParent() : nullptr;
+    llvm::BranchInst *guard2Branch = guarded ? L2->getLoopGuardBranch() : nullptr;
+
     /**
-     * Sostituzione delle induction variables di L2 con quelle di L1.
-     * Le IV sono i contatori (es: i, j...)
+     * Blocchi il cui terminatore può cambiare, con i successori attuali, e blocchi che
+     * potrebbero diventare irraggiungibili: quelli di L2 e quelli tra l'uscita di L1 e L2.
      */
-    auto firstLoopIV = L1->getCanonicalInductionVariable();
-    auto secondLoopIV = L2->getCanonicalInductionVariable();
-
-    secondLoopIV->replaceAllUsesWith(firstLoopIV);
+    llvm::SmallVector<llvm::BasicBlock *, 16> touched(L1->blocks());
+    touched.append(L2->block_begin(), L2->block_end());
+    llvm::SmallSetVector<llvm::BasicBlock *, 16> candidates(L2->block_begin(), L2->block_end());
+    candidates.insert(L1->getExitBlock());
+    candidates.insert(L2->getLoopPreheader());
+    if (guarded)
+    {
+        touched.push_back(guard1);
+        candidates.insert(guard2Branch->getParent());
+    }
+    llvm::DenseMap<llvm::BasicBlock *, llvm::SmallSetVector<llvm::BasicBlock *, 2>> oldSuccs;
+    for (auto *BB : touched)
+        oldSuccs[BB].insert(succ_begin(BB), succ_end(BB));
 
     auto header1 = L1->getHeader();
     auto header2 = L2->getHeader();
+    auto preheader1 = L1->getLoopPreheader();
+    auto preheader2 = L2->getLoopPreheader();
     auto latch1 = L1->getLoopLatch();
     auto latch2 = L2->getLoopLatch();
+    auto exiting1 = L1->getExitingBlock();
+    auto exit1 = L1->getExitBlock();
     auto exit = L2->getUniqueExitBlock();
+    bool rotated = exiting1 == latch1;
+
+    // PHI LCSSA all'uscita di L1: i valori di L1 dominano anche l'uscita del loop fuso
+    for (llvm::PHINode &phi : llvm::make_early_inc_range(exit1->phis()))
+        if (phi.getNumIncomingValues() == 1)
+        {
+            phi.replaceAllUsesWith(phi.getIncomingValue(0));
+            phi.eraseFromParent();
+        }
 
-    if (!L1->isGuarded())
+    // PHI di L2 riscrivibili come ricorrenze su L1, e valore per l'iterazione successiva
+    const llvm::DataLayout &DL = header1->getModule()->getDataLayout();
+    llvm::SmallVector<std::pair<llvm::PHINode *, const llvm::SCEV *>, 4> rewritten;
+    llvm::SmallVector<llvm::PHINode *, 4> movedPhis;
+    llvm::DenseMap<llvm::PHINode *, llvm::WeakTrackingVH> nextValue;
+    for (llvm::PHINode &phi : header2->phis())
     {
-        /**
-         * Modifiche al Control Flow Graph (unguarded):
-         * 1. Header L1 --> Exit L2
-         * 2. Body L1 --> Body L2
-         * 3. Body L2 --> Latch L1
-         * 4. Header L2 --> Latch L2
-         */
+        nextValue[&phi] = rotated ? phi.getIncomingValueForBlock(latch2) : &phi;
+        auto *AR = SE.isSCEVable(phi.getType()) ? llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(&phi)) : nullptr;
+        if (AR && AR->getLoop() == L2 && AR->isAffine() &&
+            isExpandableAt(AR->getStart(), preheader1->getTerminator(), DT) &&
+            isExpandableAt(AR->getStepRecurrence(SE), preheader1->getTerminator(), DT))
+            rewritten.push_back({&phi, SE.getAddRecExpr(AR->getStart(), AR->getStepRecurrence(SE), L1, llvm::SCEV::FlagAnyWrap)});
+        else
+            movedPhis.push_back(&phi);
+    }
 
-        // dropBack(1) mi toglie il latch dalla lista, back() mi prende il body
-        llvm::BasicBlock *lastL1BB = L1->getBlocks().drop_back(1).back();
+    /**
+     * Loop di resto: copia del loop più lungo, con il preheader clonato vuoto (la copia usa i
+     * valori del preheader originale) e con le PHI dell'header che partono dai valori che hanno
+     * all'uscita del loop fuso. Esce dove esce L2.
+     * Se il più lungo è L1 e i loop non sono ruotati, il loop fuso deve fermarsi dopo le
+     * iterazioni di L2: il test nell'header di L1 diventa iterazione != backedge di L2. Nei loop
+     * ruotati basta il test del latch del loop più corto.
+     */
+    llvm::BasicBlock *restPreheader = nullptr;
+    llvm::SmallVector<std::pair<llvm::PHINode *, llvm::PHINode *>, 4> restPhis;
+    if (peel)
+    {
+        llvm::Loop *longer = peel > 0 ? L1 : L2;
+        auto *preheader = longer->getLoopPreheader();
+        auto *longerExit = longer->getExitBlock();
+        llvm::ValueToValueMapTy VMap;
+        llvm::SmallVector<llvm::BasicBlock *, 16> cloned;
+        llvm::cloneLoopWithPreheader(exit, preheader, longer, VMap, ".rest", &LI, &DT, cloned);
+        restPreheader = llvm::cast<llvm::BasicBlock>(VMap[preheader]);
+        for (llvm::Instruction &I : *preheader)
+            if (!I.isTerminator())
+            {
+                llvm::cast<llvm::Instruction>(VMap[&I])->eraseFromParent();
+                VMap[&I] = &I;
+            }
+        llvm::remapInstructionsInBlocks(cloned, VMap);
+        llvm::cast<llvm::BasicBlock>(VMap[longer->getExitingBlock()])->getTerminator()->replaceUsesOfWith(longerExit, exit);
+        for (llvm::PHINode &phi : longer->getHeader()->phis())
+            restPhis.push_back({&phi, llvm::cast<llvm::PHINode>(VMap[&phi])});
 
-        // collegamento body loop2 al body loop1 (tolgo sia latch che header)
-        lastL1BB->getTerminator()->setSuccessor(0, L2->getBlocks().drop_front(1).drop_back(1).front());
+        if (peel > 0 && !rotated)
+        {
+            auto *backedges1 = SE.getBackedgeTakenCount(L1);
+            auto *backedges2 = SE.getMinusSCEV(backedges1, SE.getConstant(backedges1->getType(), peel));
+            llvm::SCEVExpander expander(SE, DL, "fusion");
+            llvm::Value *bound = expander.expandCodeFor(backedges2, backedges2->getType(), preheader1->getTerminator());
+            llvm::Value *iteration = expander.expandCodeFor(SE.getAddRecExpr(SE.getZero(backedges2->getType()), SE.getOne(backedges2->getType()),
+                                                                             L1, llvm::SCEV::FlagAnyWrap),
+                                                            backedges2->getType(), &*header1->getFirstInsertionPt());
+            auto *exitBranch = llvm::cast<llvm::BranchInst>(exiting1->getTerminator());
+            llvm::Value *oldCond = exitBranch->getCondition();
+            llvm::IRBuilder<> builder(exitBranch);
+            exitBranch->setCondition(L1->contains(exitBranch->getSuccessor(0))
+                                         ? builder.CreateICmpNE(iteration, bound, "fused.cond")
+                                         : builder.CreateICmpEQ(iteration, bound, "fused.cond"));
+            llvm::RecursivelyDeleteTriviallyDeadInstructions(oldCond);
+        }
+        LLVM_DEBUG(llvm::dbgs() << "[loopFusion] " << std::abs(peel) << " iterazioni di "
+                                << (peel > 0 ? "L1" : "L2") << " nel loop di resto\n");
+        ++NumPeeled;
+    }
 
-        // collegamento body loop2 latch loop1
-        L2->getBlocks().drop_front(1).drop_back(1).back()->getTerminator()->setSuccessor(0, latch1);
+    // Le ricorrenze di L2 diventano espressioni delle IV di L1, calcolate all'inizio dell'iterazione
+    llvm::SmallVector<llvm::WeakTrackingVH, 8> maybeDead;
+    {
+        llvm::SCEVExpander expander(SE, DL, "fusion");
+        llvm::Instruction *at = &*header1->getFirstInsertionPt();
+        for (auto &R : rewritten)
+        {
+            llvm::Value *value = expander.expandCodeFor(R.second, R.first->getType(), at);
+            LLVM_DEBUG(llvm::dbgs() << "[loopFusion] " << *R.first << " diventa " << *value << "\n");
+            maybeDead.push_back(R.first->getIncomingValueForBlock(latch2));
+            R.first->replaceAllUsesWith(value);
+            R.first->eraseFromParent();
+        }
+    }
 
-        // collegamento header loop2 al latch loop2
-        llvm::BranchInst::Create(latch2, header2->getTerminator());
-        header2->getTerminator()->eraseFromParent();
+    SE.forgetLoop(L1);
+    SE.forgetLoop(L2);
 
-        // collegamento header loop1 all'L2 exit
-        llvm::BranchInst::Create(L1->getBlocks().drop_front(1).front(), exit, header1->back().getOperand(0), header1->getTerminator());
-        header1->getTerminator()->eraseFromParent();
+    // Il backedge del loop fuso parte dal latch di L2
+    for (llvm::PHINode &phi : header1->phis())
+        phi.replaceIncomingBlockWith(latch1, latch2);
+    for (auto *phi : movedPhis)
+    {
+        phi->moveBefore(header1->getFirstNonPHI());
+        phi->replaceIncomingBlockWith(preheader2, preheader1);
+    }
+
+    auto *branch1 = llvm::cast<llvm::BranchInst>(exiting1->getTerminator());
+    auto *branch2 = llvm::cast<llvm::BranchInst>(L2->getExitingBlock()->getTerminator());
+    llvm::BasicBlock *fusedExiting;
+    if (!rotated)
+    {
+        // header1 --> exit L2, latch1 --> header2 --> corpo L2, latch2 --> header1
+        branch1->replaceSuccessorWith(exit1, exit);
+        latch1->getTerminator()->replaceSuccessorWith(header1, header2);
+        maybeDead.push_back(branch2->getCondition());
+        llvm::BranchInst::Create(branch2->getSuccessor(L2->contains(branch2->getSuccessor(0)) ? 0 : 1), branch2);
+        branch2->eraseFromParent();
+        latch2->getTerminator()->replaceSuccessorWith(header2, header1);
+        exit->replacePhiUsesWith(header2, header1);
+        fusedExiting = header1;
     }
     else
     {
-        // modifiche al control flow graph eseguite:
-        // guard1 --> L2 exit
-        // latch1 --> L2 exit
-        // header1 --> header2
-        // header2 --> latch1
+        // latch1 --> header2, latch2 --> header1 / exit L2 con il test del loop più corto
+        auto *test = peel < 0 ? branch1 : branch2;
+        bool stayFirst = test->getParent() == latch1 ? L1->contains(test->getSuccessor(0)) : L2->contains(test->getSuccessor(0));
+        llvm::Value *cond = test->getCondition();
+        maybeDead.push_back(peel < 0 ? branch2->getCondition() : branch1->getCondition());
+        llvm::BranchInst::Create(stayFirst ? header1 : exit, stayFirst ? exit : header1, cond, branch2);
+        branch2->eraseFromParent();
+        llvm::BranchInst::Create(header2, branch1);
+        branch1->eraseFromParent();
+        fusedExiting = latch2;
+
+        if (guarded)
+        {
+            /**
+             * La guardia di L1 salta direttamente nel blocco in cui la guardia di L2 salta il
+             * loop: le due guardie hanno la stessa condizione, quindi se la prima salta L1 la
+             * seconda salterebbe anche L2. In questo modo l'uscita di L2 resta dedicata al
+             * loop fuso, che rimane guarded e adiacente al loop successivo.
+             */
+            auto *skip2 = guard2Branch->getSuccessor(guard2Branch->getSuccessor(0) == preheader2 ? 1 : 0);
+            auto *guard1Branch = llvm::cast<llvm::BranchInst>(guard1->getTerminator());
+            guard1Branch->setSuccessor(guard1Branch->getSuccessor(0) == preheader1 ? 1 : 0, skip2);
+            skip2->replacePhiUsesWith(guard2Branch->getParent(), guard1);
+        }
+    }
+
+    // Il loop fuso esce nel loop di resto, che riparte dai valori del loop fuso
+    if (restPreheader)
+    {
+        fusedExiting->getTerminator()->replaceSuccessorWith(exit, restPreheader);
+        for (auto &P : restPhis)
+        {
+            llvm::Value *start = peel > 0 ? (rotated ? P.first->getIncomingValueForBlock(latch2) : P.first)
+                                          : (llvm::Value *)nextValue[P.first];
+            P.second->setIncomingValueForBlock(restPreheader, start);
+        }
+    }
+    llvm::RecursivelyDeleteTriviallyDeadInstructionsPermissive(maybeDead);
+
+    // Aggiornamento di DT e PDT con gli archi cambiati
+    llvm::DomTreeUpdater DTU(DT, PDT, llvm::DomTreeUpdater::UpdateStrategy::Lazy);
+    llvm::SmallVector<llvm::DominatorTree::UpdateType, 16> updates;
+    for (auto *BB : touched)
+    {
+        llvm::SmallSetVector<llvm::BasicBlock *, 2> newSuccs(succ_begin(BB), succ_end(BB));
+        for (auto *succ : oldSuccs[BB])
+            if (!newSuccs.count(succ))
+                updates.push_back({llvm::DominatorTree::Delete, BB, succ});
+        for (auto *succ : newSuccs)
+            if (!oldSuccs[BB].count(succ))
+                updates.push_back({llvm::DominatorTree::Insert, BB, succ});
+    }
+    if (!restPreheader)
+        DTU.applyUpdates(updates);
+
+    /**
+     * Un candidato resta raggiungibile se ha un predecessore fuori dai candidati, o un
+     * predecessore candidato a sua volta raggiungibile; gli altri vengono cancellati.
+     */
+    llvm::SmallPtrSet<llvm::BasicBlock *, 16> live;
+    llvm::SmallVector<llvm::BasicBlock *, 16> worklist;
+    for (auto *BB : candidates)
+        if (llvm::any_of(predecessors(BB), [&](llvm::BasicBlock *pred)
+                         { return !candidates.count(pred); }))
+            worklist.push_back(BB);
+    while (!worklist.empty())
+    {
+        auto *BB = worklist.pop_back_val();
+        if (!live.insert(BB).second)
+            continue;
+        for (auto *succ : successors(BB))
+            if (candidates.count(succ))
+                worklist.push_back(succ);
+    }
+    llvm::SmallVector<llvm::BasicBlock *, 8> dead;
+    for (auto *BB : candidates)
+        if (!live.count(BB))
+        {
+            dead.push_back(BB);
+            LI.removeBlock(BB);
+        }
 
-        auto guard1 = L1->getLoopGuardBranch()->getParent();
+    // I blocchi rimasti di L2 entrano in L1, dopo i suoi
+    llvm::SmallVector<llvm::BasicBlock *, 8> moved(L2->blocks());
+    for (auto *BB : moved)
+    {
+        L2->removeBlockFromLoop(BB);
+        if (LI.getLoopFor(BB) == L2)
+            LI.changeLoopFor(BB, L1);
+        L1->addBlockEntry(BB);
+    }
+    while (!L2->isInnermost())
+    {
+        auto child = L2->begin();
+        llvm::Loop *childLoop = *child;
+        L2->removeChildLoop(child);
+        L1->addChildLoop(childLoop);
+    }
+    LI.erase(L2);
 
-        // collegamento guard loop1 all' L2 exit
-        llvm::BranchInst::Create(L1->getLoopPreheader(), exit, guard1->back().getOperand(0), guard1->getTerminator());
-        guard1->getTerminator()->eraseFromParent();
+    if (!restPreheader)
+    {
+        llvm::DeleteDeadBlocks(dead, &DTU);
+        DTU.flush();
+        return;
+    }
+    llvm::DeleteDeadBlocks(dead);
+    DT.recalculate(*header1->getParent());
+    PDT.recalculate(*header1->getParent());
+}
+
+/**
+ * Forwarding store -> load nel loop fuso e contrazione degli array temporanei.
+ *
+ * Dopo la fusione di un loop che scrive tmp[i] con uno che lo rilegge, ogni iterazione
+ * salva un valore e lo ricarica subito. Per ogni load del loop la cui cella può essere
+ * scritta da una sola istruzione del loop, una store semplice dello stesso tipo, la distanza
+ * d tra le due si calcola come in dependenceDistance:
+ *  - d = 0 (stesso puntatore), e la store domina la load: la load diventa il valore salvato;
+ *  - 0 < d <= MaxRotation, e la store avviene a ogni iterazione: la load legge il valore
+ *    salvato d iterazioni prima, che viene tenuto in un buffer rotante di d PHI nell'header.
+ *    Le prime d iterazioni leggono celle scritte prima del loop: i valori iniziali delle PHI
+ *    si caricano nel preheader, solo se quelle celle sono sicuramente accessibili.
+ * Se alla fine un array locale (alloca) non viene più letto né passato ad altre istruzioni,
+ * le sue store sono inutili: l'array viene eliminato e i valori restano solo in registri.
+ */
+void forwardStores(llvm::Loop *L, llvm::ScalarEvolution &SE, llvm::DominatorTree &DT, llvm::AAResults &AA)
+{
+    const int64_t MaxRotation = 8;
+    llvm::BasicBlock *preheader = L->getLoopPreheader(), *header = L->getHeader(), *latch = L->getLoopLatch();
+    if (!preheader || !latch)
+        return;
+
+    llvm::SmallVector<llvm::LoadInst *, 8> loads;
+    llvm::SmallVector<llvm::Instruction *, 8> writers;
+    for (auto *BB : L->getBlocks())
+        for (llvm::Instruction &I : *BB)
+        {
+            if (auto *load = llvm::dyn_cast<llvm::LoadInst>(&I))
+                if (load->isSimple())
+                    loads.push_back(load);
+            if (I.mayWriteToMemory())
+                writers.push_back(&I);
+        }
+
+    const llvm::DataLayout &DL = header->getModule()->getDataLayout();
+    llvm::SmallSetVector<llvm::Value *, 4> objects;
+    for (auto *load : loads)
+    {
+        // L'unica istruzione del loop che può scrivere la cella letta, in qualsiasi iterazione
+        auto loc = llvm::MemoryLocation::getBeforeOrAfter(load->getPointerOperand(), load->getAAMetadata());
+        llvm::StoreInst *source = nullptr;
+        bool single = 1;
+        for (auto *W : writers)
+            if (llvm::isModSet(AA.getModRefInfo(W, loc)))
+            {
+                single &= !source && llvm::isa<llvm::StoreInst>(W) && llvm::cast<llvm::StoreInst>(W)->isSimple();
+                source = llvm::dyn_cast<llvm::StoreInst>(W);
+            }
+        if (!single || !source || source->getValueOperand()->getType() != load->getType())
+            continue;
+
+        int64_t d = 0;
+        if (SE.getSCEV(source->getPointerOperand()) != SE.getSCEV(load->getPointerOperand()) &&
+            !dependenceDistance(source, load, std::make_pair(L, L), SE, d))
+            continue;
+
+        llvm::Value *value;
+        if (d == 0)
+        {
+            if (!DT.dominates(source, load))
+                continue;
+            value = source->getValueOperand();
+            ++NumForwarded;
+        }
+        else
+        {
+            auto *AR = llvm::cast<llvm::SCEVAddRecExpr>(SE.getSCEV(source->getPointerOperand()));
+            if (d < 0 || d > MaxRotation || !AR->hasNoSelfWrap() || !DT.dominates(source->getParent(), latch))
+                continue;
+
+            // Celle lette nelle prime d iterazioni: start - k*step, con k = 1..d
+            llvm::SCEVExpander expander(SE, DL, "fwd");
+            llvm::SCEVExpanderCleaner cleaner(expander);
+            llvm::SmallVector<llvm::Value *, 8> initial;
+            for (int64_t k = 1; k <= d; ++k)
+            {
+                const llvm::SCEV *address = SE.getAddExpr(AR->getStart(), SE.getMulExpr(SE.getConstant(AR->getStepRecurrence(SE)->getType(), -k),
+                                                                                          AR->getStepRecurrence(SE)));
+                if (!isExpandableAt(address, preheader->getTerminator(), DT))
+                    break;
+                llvm::Value *pointer = expander.expandCodeFor(address, source->getPointerOperandType(), preheader->getTerminator());
+                if (!llvm::isSafeToLoadUnconditionally(pointer, load->getType(), load->getAlign(), DL, preheader->getTerminator(), &DT))
+                    break;
+                initial.push_back(pointer);
+            }
+            if (initial.size() != uint64_t(d))
+                continue;
+            cleaner.markResultUsed();
+
+            // rotation[k-1] vale quanto salvato k iterazioni prima
+            llvm::IRBuilder<> builder(preheader->getTerminator());
+            llvm::SmallVector<llvm::PHINode *, 8> rotation;
+            for (int64_t k = 1; k <= d; ++k)
+            {
+                auto *phi = llvm::PHINode::Create(load->getType(), 2, "fwd.rot", &*header->getFirstInsertionPt());
+                phi->addIncoming(builder.CreateAlignedLoad(load->getType(), initial[k - 1], load->getAlign(), "fwd.init"), preheader);
+                phi->addIncoming(k == 1 ? source->getValueOperand() : rotation.back(), latch);
+                rotation.push_back(phi);
+            }
+            value = rotation.back();
+            ++NumRotated;
+        }
 
-        // collegamento latch loop1 all'L2 exit
-        llvm::BranchInst::Create(L1->getBlocks().front(), exit, latch1->back().getOperand(0), latch1->getTerminator());
-        latch1->getTerminator()->eraseFromParent();
+        LLVM_DEBUG(llvm::dbgs() << "[forwardStores] " << *load << " <- " << *value << " (distanza " << d << ")\n");
+        objects.insert(llvm::getUnderlyingObject(source->getPointerOperand()));
+        SE.forgetValue(load);
+        load->replaceAllUsesWith(value);
+        llvm::RecursivelyDeleteTriviallyDeadInstructions(load);
+    }
 
-        // collegamento header loop1 all'header loop2
-        L1->getBlocks().drop_back(1).back()->getTerminator()->setSuccessor(0, L2->getBlocks().front());
+    // Array locali di cui restano solo store: si eliminano
+    for (llvm::Value *object : objects)
+    {
+        auto *array = llvm::dyn_cast<llvm::AllocaInst>(object);
+        if (!array)
+            continue;
 
-        // collegamento header loop2 al latch loop1
-        L2->getBlocks().drop_back(1).back()->getTerminator()->setSuccessor(0, latch1);
+        llvm::SmallVector<llvm::Instruction *, 16> dead;
+        llvm::SmallVector<llvm::WeakTrackingVH, 16> pointers;
+        llvm::SmallVector<llvm::Instruction *, 8> worklist = {array};
+        bool onlyStores = 1;
+        while (!worklist.empty() && onlyStores)
+        {
+            llvm::Instruction *I = worklist.pop_back_val();
+            for (llvm::Use &U : I->uses())
+            {
+                auto *user = llvm::cast<llvm::Instruction>(U.getUser());
+                auto *store = llvm::dyn_cast<llvm::StoreInst>(user);
+                if (llvm::isa<llvm::GetElementPtrInst>(user) || llvm::isa<llvm::BitCastInst>(user))
+                    worklist.push_back(user);
+                else if ((store && store->isSimple() && U.getOperandNo() == store->getPointerOperandIndex()) ||
+                         user->isLifetimeStartOrEnd())
+                {
+                    dead.push_back(user);
+                    pointers.push_back(I);
+                }
+                else
+                    onlyStores = 0;
+            }
+        }
+        if (!onlyStores)
+            continue;
 
-        // rimozione header loop2 - PHI node
-        header2->front().eraseFromParent();
+        LLVM_DEBUG(llvm::dbgs() << "[forwardStores] Array contratto: " << *array << "\n");
+        for (auto *I : dead)
+            I->eraseFromParent();
+        llvm::RecursivelyDeleteTriviallyDeadInstructionsPermissive(pointers);
+        ++NumContracted;
     }
 }
 
@@ -300,31 +1260,518 @@ llvm::PreservedAnalyses llvm::LoopFusion::run(Function &F, FunctionAnalysisManag
     llvm::DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
     llvm::PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
     llvm::ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    llvm::DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    llvm::AAResults &AA = AM.getResult<llvm::AAManager>(F);
+    llvm::TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    llvm::OptimizationRemarkEmitter &ORE = AM.getResult<llvm::OptimizationRemarkEmitterAnalysis>(F);
 
-    // Set con coppie di loop adiacenti
-    std::set<std::pair<llvm::Loop *, llvm::Loop *>> adjacentLoops{};
+    bool modified = 0;
+
+    // Remark "missed" con il motivo per cui la coppia non viene fusa
+    auto missed = [&ORE](std::pair<llvm::Loop *, llvm::Loop *> &loop, llvm::StringRef Name, llvm::StringRef Reason)
+    {
+        ORE.emit([&]()
+                 { return llvm::OptimizationRemarkMissed(DEBUG_TYPE, Name, loop.first->getStartLoc(), loop.first->getHeader())
+                          << "loop non fusi: " << Reason; });
+    };
+
+    /**
+     * Fusione greedy, nell'ordine del programma: dopo ogni fusione L1 è cambiato e L2 non
+     * esiste più, quindi le coppie si ricalcolano (adjLoops è lineare nel numero di loop)
+     * e la prima coppia legale viene fusa. Una catena L1;L2;L3;L4 diventa così un solo
+     * loop, che cresce a ogni passo. Ci si ferma quando nessuna coppia è più fondibile.
+     * Le coppie scartate non vengono ricontrollate finché uno dei due loop non cambia.
+     */
+    llvm::DenseSet<std::pair<llvm::Loop *, llvm::Loop *>> rejected;
+    bool fused = 1;
+    while (fused)
+    {
+        fused = 0;
 
-    adjLoops(adjacentLoops, LI);
+        // Coppie di loop adiacenti, nell'ordine in cui compaiono nella funzione
+        llvm::SmallVector<std::pair<llvm::Loop *, llvm::Loop *>, 8> adjacentLoops;
+        adjLoops(adjacentLoops, LI);
+
+        for (std::pair<llvm::Loop *, llvm::Loop *> loop : adjacentLoops)
+        {
+            if (rejected.count(loop))
+                continue;
+            if (!checkEquivalence(loop, DT, PDT))
+            {
+                ++NumNotEquivalent;
+                missed(loop, "NotEquivalent", "control flow non equivalente");
+                rejected.insert(loop);
+                continue;
+            }
+            if (!checkShape(loop))
+            {
+                ++NumBadShape;
+                missed(loop, "Shape", "forma dei loop non supportata");
+                rejected.insert(loop);
+                continue;
+            }
+            int64_t peel;
+            if (!TripCount(loop, SE, peel))
+            {
+                ++NumTripCountMismatch;
+                missed(loop, "TripCount", "trip count diverso o non calcolabile");
+                rejected.insert(loop);
+                continue;
+            }
+            if (peel && !canPeel(loop, peel, SE, DT))
+            {
+                ++NumTripCountMismatch;
+                missed(loop, "Peel", "trip count diverso e iterazioni in più non separabili");
+                rejected.insert(loop);
+                continue;
+            }
+            if (!negDependencies(loop, DI, SE))
+            {
+                ++NumNegDependencies;
+                missed(loop, "NegDependencies", "dipendenze negative tra i due loop");
+                rejected.insert(loop);
+                continue;
+            }
+            llvm::SmallVector<std::pair<llvm::Instruction *, llvm::Instruction *>, 8> moves;
+            if (!interveningCode(loop, DT, AA, peel, moves))
+            {
+                ++NumNotMovable;
+                missed(loop, "InterveningCode", "codice tra i due loop non spostabile");
+                rejected.insert(loop);
+                continue;
+            }
+            std::string reason;
+            if (UseProfitability && !profitable(loop, SE, TTI, reason))
+            {
+                ++NumNotProfitable;
+                missed(loop, "NotProfitable", reason);
+                rejected.insert(loop);
+                continue;
+            }
+
+            LLVM_DEBUG(llvm::dbgs() << "I loop possono essere fusi\n");
+            ORE.emit([&]()
+                     { return llvm::OptimizationRemark(DEBUG_TYPE, "Fused", loop.first->getStartLoc(), loop.first->getHeader())
+                              << "loop fusi"; });
+            for (auto &move : moves)
+                move.first->moveBefore(move.second);
+            NumMovedIntervening += moves.size();
+            loopFusion(loop.first, loop.second, LI, DT, PDT, SE, peel);
+            if (UseForwarding)
+                forwardStores(loop.first, SE, DT, AA);
+            ++NumFused;
+
+            // Le coppie scartate che contengono L1 vanno rivalutate: il loop è cambiato
+            for (auto it = rejected.begin(); it != rejected.end();)
+            {
+                auto cur = it++;
+                if (cur->first == loop.first || cur->second == loop.first ||
+                    cur->first == loop.second || cur->second == loop.second)
+                    rejected.erase(cur);
+            }
+
+            modified = 1;
+            fused = 1;
+            break;
+        }
+    }
+
+    if (!modified)
+        return llvm::PreservedAnalyses::all();
+
+    // DT, PDT, LoopInfo e SCEV vengono aggiornati a ogni fusione
+    llvm::PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<PostDominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    PA.preserve<ScalarEvolutionAnalysis>();
+    return PA;
+}
+
+/**
+ * Istruzioni che decidono il control flow di L: i terminatori e tutto ciò da cui dipendono
+ * dentro il loop (IV, confronti, ...). Vengono copiate in ogni loop distribuito, quindi non
+ * possono accedere alla memoria: altrimenti le copie potrebbero fare iterazioni diverse.
+ */
+bool controlSlice(llvm::Loop *L, llvm::SmallPtrSetImpl<llvm::Instruction *> &control)
+{
+    llvm::SmallVector<llvm::Instruction *, 8> worklist;
+    for (auto *BB : L->getBlocks())
+        worklist.push_back(BB->getTerminator());
+
+    while (!worklist.empty())
+    {
+        llvm::Instruction *I = worklist.pop_back_val();
+        if (!L->contains(I) || !control.insert(I).second)
+            continue;
+        if (I->mayReadOrWriteMemory())
+            return 0;
+        for (llvm::Value *op : I->operands())
+            if (auto *def = llvm::dyn_cast<llvm::Instruction>(op))
+                worklist.push_back(def);
+    }
+    return 1;
+}
+
+/**
+ * Partizioni del corpo di L per la distribuzione, nell'ordine in cui vanno eseguite.
+ *
+ * Il grafo delle dipendenze ha un nodo per ogni istruzione fuori dal control flow e un arco
+ * X -> Y quando X deve precedere Y:
+ *  - def-use dentro il loop, compresi gli archi loop-carried verso le PHI dell'header;
+ *  - dipendenze in memoria, con memoryDependence come in negDependencies: per A prima di B
+ *    nel corpo, la distanza b - a tra le iterazioni che toccano la stessa cella dice se
+ *    l'accesso di A precede quello di B (positiva '<', nulla '='), o lo segue (negativa '>').
+ *    Se la distanza non è calcolabile si usa la direzione di DependenceInfo sul loop, e se
+ *    anche questa manca valgono entrambe (dipendenza sconosciuta, accessi opachi).
+ * Le componenti fortemente connesse (Tarjan) sono i gruppi di istruzioni che non si possono
+ * separare; il grafo delle componenti è aciclico e un suo ordine topologico è un ordine
+ * legale per i loop distribuiti.
+ * Le componenti di una sola istruzione senza effetti (aritmetica, indirizzi, load da memoria
+ * che il loop non scrive) non formano partizioni: si ricalcolano in ogni loop che le usa.
+ * Le altre, in ordine topologico, si raggruppano: quelle acicliche consecutive (vettorizzabili)
+ * stanno insieme, e così quelle cicliche (ricorrenze). Infine un valore che passa per registro
+ * da una partizione a un'altra le costringe nello stesso loop, con tutte quelle in mezzo.
+ */
+void partitionLoop(llvm::Loop *L, llvm::LoopInfo &LI, llvm::DependenceInfo &DI, llvm::ScalarEvolution &SE,
+                   const llvm::SmallPtrSetImpl<llvm::Instruction *> &control,
+                   llvm::SmallVectorImpl<llvm::SmallVector<llvm::Instruction *, 8>> &partitions)
+{
+    // Nodi nell'ordine del corpo
+    llvm::LoopBlocksRPO RPO(L);
+    RPO.perform(&LI);
+    llvm::SmallVector<llvm::Instruction *, 32> nodes;
+    llvm::DenseMap<llvm::Instruction *, unsigned> index;
+    for (auto *BB : RPO)
+        for (llvm::Instruction &I : *BB)
+            if (!control.count(&I))
+            {
+                index[&I] = nodes.size();
+                nodes.push_back(&I);
+            }
+
+    unsigned n = nodes.size();
+    std::vector<llvm::SmallVector<unsigned, 4>> uses(n), edges(n);
+    std::vector<bool> usedOutside(n, false);
+    for (unsigned v = 0; v < n; ++v)
+        for (llvm::User *U : nodes[v]->users())
+        {
+            auto it = index.find(llvm::cast<llvm::Instruction>(U));
+            if (it == index.end())
+            {
+                usedOutside[v] = true;
+                continue;
+            }
+            uses[v].push_back(it->second);
+            edges[v].push_back(it->second);
+        }
+
+    // Dipendenze in memoria; aliased: l'accesso tocca memoria che il loop scrive
+    std::vector<bool> aliased(n, false);
+    llvm::SmallVector<unsigned, 16> accesses;
+    for (unsigned v = 0; v < n; ++v)
+        if (nodes[v]->mayReadOrWriteMemory())
+            accesses.push_back(v);
+    for (unsigned a = 0; a < accesses.size(); ++a)
+        for (unsigned b = a + 1; b < accesses.size(); ++b)
+        {
+            unsigned va = accesses[a], vb = accesses[b];
+            if (!nodes[va]->mayWriteToMemory() && !nodes[vb]->mayWriteToMemory())
+                continue;
+            bool known;
+            int64_t distance;
+            auto D = memoryDependence(nodes[va], nodes[vb], std::make_pair(L, L), DI, SE, known, distance);
+            if (!D)
+                continue;
+            aliased[va] = aliased[vb] = true;
+            unsigned dir = llvm::Dependence::DVEntry::ALL;
+            if (known)
+                dir = distance > 0 ? llvm::Dependence::DVEntry::LT
+                      : distance ? llvm::Dependence::DVEntry::GT
+                                 : llvm::Dependence::DVEntry::EQ;
+            else if (D->getLevels() && !D->isConfused())
+                dir = D->getDirection(D->getLevels());
+            if (dir & (llvm::Dependence::DVEntry::LT | llvm::Dependence::DVEntry::EQ))
+                edges[va].push_back(vb);
+            if (dir & llvm::Dependence::DVEntry::GT)
+                edges[vb].push_back(va);
+        }
+
+    // Tarjan: le componenti escono in ordine topologico inverso
+    std::vector<int> num(n, -1), low(n, 0), comp(n, -1);
+    std::vector<bool> onStack(n, false);
+    llvm::SmallVector<unsigned, 32> stack;
+    int counter = 0, ncomp = 0;
+    std::function<void(unsigned)> visit = [&](unsigned v)
+    {
+        num[v] = low[v] = counter++;
+        stack.push_back(v);
+        onStack[v] = true;
+        for (unsigned w : edges[v])
+        {
+            if (num[w] < 0)
+            {
+                visit(w);
+                low[v] = std::min(low[v], low[w]);
+            }
+            else if (onStack[w])
+                low[v] = std::min(low[v], num[w]);
+        }
+        if (low[v] == num[v])
+        {
+            unsigned w;
+            do
+            {
+                w = stack.pop_back_val();
+                onStack[w] = false;
+                comp[w] = ncomp;
+            } while (w != v);
+            ++ncomp;
+        }
+    };
+    for (unsigned v = 0; v < n; ++v)
+        if (num[v] < 0)
+            visit(v);
+
+    std::vector<unsigned> size(ncomp, 0);
+    std::vector<bool> cyclic(ncomp, false);
+    for (unsigned v = 0; v < n; ++v)
+    {
+        ++size[comp[v]];
+        for (unsigned w : edges[v])
+            if (w == v)
+                cyclic[comp[v]] = true;
+    }
+    std::vector<bool> shared(n, false);
+    for (unsigned v = 0; v < n; ++v)
+    {
+        llvm::Instruction *I = nodes[v];
+        if (size[comp[v]] > 1 || cyclic[comp[v]])
+            cyclic[comp[v]] = true;
+        else if (auto *load = llvm::dyn_cast<llvm::LoadInst>(I))
+            shared[v] = load->isSimple() && !aliased[v];
+        else
+            shared[v] = !I->mayReadOrWriteMemory() && !I->mayHaveSideEffects();
+    }
+
+    // Partizioni in ordine topologico, unendo le componenti consecutive dello stesso tipo
+    std::vector<int> partOf(ncomp, -1);
+    llvm::SmallVector<bool, 8> kinds;
+    std::vector<bool> sharedComp(ncomp, false);
+    for (unsigned v = 0; v < n; ++v)
+        sharedComp[comp[v]] = shared[v];
+    for (int c = ncomp - 1; c >= 0; --c)
+    {
+        if (sharedComp[c])
+            continue;
+        if (kinds.empty() || kinds.back() != cyclic[c])
+            kinds.push_back(cyclic[c]);
+        partOf[c] = kinds.size() - 1;
+    }
+    if (kinds.size() < 2)
+    {
+        partitions.resize(kinds.size());
+        for (unsigned v = 0; v < n; ++v)
+            if (!shared[v])
+                partitions[0].push_back(nodes[v]);
+        return;
+    }
+
+    /**
+     * Valori che passano per registro da una partizione all'altra, anche attraverso istruzioni
+     * condivise: join[k] unisce la partizione k alla k+1. Un valore condiviso usato dopo il
+     * loop resta nel loop originale, che esegue l'ultima partizione.
+     */
+    unsigned last = kinds.size() - 1;
+    std::vector<bool> join(kinds.size(), false);
+    for (unsigned v = 0; v < n; ++v)
+    {
+        if (shared[v])
+            continue;
+        unsigned p = partOf[comp[v]];
+        llvm::SmallVector<unsigned, 8> worklist(uses[v].begin(), uses[v].end());
+        llvm::DenseSet<unsigned> seen;
+        while (!worklist.empty())
+        {
+            unsigned w = worklist.pop_back_val();
+            if (!seen.insert(w).second)
+                continue;
+            unsigned q;
+            if (shared[w])
+            {
+                worklist.append(uses[w].begin(), uses[w].end());
+                if (!usedOutside[w])
+                    continue;
+                q = last;
+            }
+            else
+                q = partOf[comp[w]];
+            for (unsigned k = std::min(p, q); k < std::max(p, q); ++k)
+                join[k] = true;
+        }
+    }
+
+    std::vector<unsigned> group(kinds.size());
+    unsigned groups = 0;
+    for (unsigned k = 0; k < kinds.size(); ++k)
+    {
+        group[k] = groups;
+        if (!join[k])
+            ++groups;
+    }
+    partitions.resize(groups);
+    for (unsigned v = 0; v < n; ++v)
+        if (!shared[v])
+            partitions[group[partOf[comp[v]]]].push_back(nodes[v]);
+}
+
+/**
+ * Distribuzione di L: una copia del loop per ogni partizione tranne l'ultima, che resta nel
+ * loop originale. Le copie vengono messe una dopo l'altra prima di L, nell'ordine delle
+ * partizioni: l'uscita di ognuna porta al preheader della successiva. Da ogni copia si tolgono
+ * le istruzioni delle altre partizioni e il codice condiviso che non serve più; il control
+ * flow resta uguale ovunque, quindi tutte le copie fanno le stesse iterazioni.
+ * I valori di una partizione usati dopo il loop vengono presi dalla sua copia.
+ */
+void distributeLoop(llvm::Loop *L, llvm::ArrayRef<llvm::SmallVector<llvm::Instruction *, 8>> partitions,
+                    llvm::LoopInfo &LI, llvm::DominatorTree &DT, llvm::ScalarEvolution &SE)
+{
+    SE.forgetLoop(L);
+
+    // Preheader vuoto e con un predecessore: le copie non ne duplicano il codice
+    llvm::BasicBlock *preheader = L->getLoopPreheader();
+    if (&preheader->front() != preheader->getTerminator() || llvm::pred_empty(preheader))
+        preheader = llvm::SplitBlock(preheader, preheader->getTerminator(), &DT, &LI);
+
+    llvm::BasicBlock *exit = L->getExitBlock(), *exiting = L->getExitingBlock();
+    llvm::BasicBlock *entry = DT.getNode(preheader)->getIDom()->getBlock();
+    llvm::SmallVector<llvm::BasicBlock *, 4> preds(llvm::predecessors(preheader));
+
+    unsigned copies = partitions.size() - 1;
+    std::vector<std::unique_ptr<llvm::ValueToValueMapTy>> maps;
+    llvm::SmallVector<llvm::BasicBlock *, 4> heads;
+    for (unsigned k = 0; k < copies; ++k)
+    {
+        maps.push_back(std::make_unique<llvm::ValueToValueMapTy>());
+        llvm::SmallVector<llvm::BasicBlock *, 16> cloned;
+        llvm::Loop *copy = llvm::cloneLoopWithPreheader(preheader, entry, L, *maps.back(), ".ldist" + llvm::Twine(k),
+                                                        &LI, &DT, cloned);
+        llvm::remapInstructionsInBlocks(cloned, *maps.back());
+        heads.push_back(copy->getLoopPreheader());
+    }
+    heads.push_back(preheader);
+
+    for (auto *pred : preds)
+        pred->getTerminator()->replaceSuccessorWith(preheader, heads[0]);
+    for (unsigned k = 0; k < copies; ++k)
+        llvm::cast<llvm::BasicBlock>((*maps[k])[exiting])->getTerminator()->replaceSuccessorWith(exit, heads[k + 1]);
+
+    for (unsigned k = 0; k < partitions.size(); ++k)
+    {
+        auto inCopy = [&](llvm::Value *V)
+        { return k < copies ? llvm::cast<llvm::Value>((*maps[k])[V]) : V; };
+
+        if (k < copies)
+            for (auto *I : partitions[k])
+                for (llvm::Use &U : llvm::make_early_inc_range(I->uses()))
+                    if (!L->contains(llvm::cast<llvm::Instruction>(U.getUser())))
+                        U.set(inCopy(I));
+
+        llvm::SmallVector<llvm::Instruction *, 16> removed;
+        for (unsigned j = 0; j < partitions.size(); ++j)
+            if (j != k)
+                for (auto *I : partitions[j])
+                    removed.push_back(llvm::cast<llvm::Instruction>(inCopy(I)));
+        for (auto *I : removed)
+            I->replaceAllUsesWith(llvm::PoisonValue::get(I->getType()));
+        for (auto *I : removed)
+            I->eraseFromParent();
+
+        llvm::SmallVector<llvm::WeakTrackingVH, 16> dead;
+        for (auto *BB : L->getBlocks())
+            for (llvm::Instruction &I : *llvm::cast<llvm::BasicBlock>(inCopy(BB)))
+                if (llvm::isInstructionTriviallyDead(&I))
+                    dead.push_back(&I);
+        llvm::RecursivelyDeleteTriviallyDeadInstructionsPermissive(dead);
+    }
+
+    DT.recalculate(*preheader->getParent());
+}
+
+llvm::PreservedAnalyses llvm::LoopDistribution::run(Function &F, FunctionAnalysisManager &AM)
+{
+    llvm::LoopInfo &LI = AM.getResult<llvm::LoopAnalysis>(F);
+    llvm::DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    llvm::ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    llvm::DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    llvm::OptimizationRemarkEmitter &ORE = AM.getResult<llvm::OptimizationRemarkEmitterAnalysis>(F);
 
     bool modified = 0;
 
-    for (std::pair<llvm::Loop *, llvm::Loop *> loop : adjacentLoops)
+    auto missed = [&ORE](llvm::Loop *L, llvm::StringRef Name, llvm::StringRef Reason)
+    {
+        ORE.emit([&]()
+                 { return llvm::OptimizationRemarkMissed("loopdistribution", Name, L->getStartLoc(), L->getHeader())
+                          << "loop non distribuito: " << Reason; });
+    };
+
+    // Solo i loop più interni, raccolti prima: le copie create non vanno ridistribuite
+    llvm::SmallVector<llvm::Loop *, 8> loops;
+    for (auto *L : LI.getLoopsInPreorder())
+        if (L->isInnermost())
+            loops.push_back(L);
+
+    for (auto *L : loops)
     {
-        if (!checkEquivalence(loop, DT, PDT))
+        if (!L->getLoopPreheader() || !L->getLoopLatch() || !L->getExitingBlock() || !L->getExitBlock())
+        {
+            missed(L, "Shape", "forma del loop non supportata");
             continue;
-        if (!TripCount(loop, SE))
+        }
+        if (llvm::isa<llvm::SCEVCouldNotCompute>(SE.getBackedgeTakenCount(L)))
+        {
+            missed(L, "TripCount", "trip count non calcolabile");
             continue;
-        if (!negDependencies(loop))
+        }
+        bool transfers = 1;
+        for (auto *BB : L->getBlocks())
+            for (llvm::Instruction &I : *BB)
+                transfers &= llvm::isGuaranteedToTransferExecutionToSuccessor(&I);
+        if (!transfers)
+        {
+            missed(L, "MayNotReturn", "istruzioni che possono non tornare o lanciare eccezioni");
+            continue;
+        }
+        llvm::SmallPtrSet<llvm::Instruction *, 16> control;
+        if (!controlSlice(L, control))
+        {
+            missed(L, "Control", "control flow che dipende dalla memoria");
             continue;
+        }
 
-        llvm::outs() << "\nI loop possono essere fusi\n";
-        loopFusion(loop.first, loop.second);
+        llvm::SmallVector<llvm::SmallVector<llvm::Instruction *, 8>, 4> partitions;
+        partitionLoop(L, LI, DI, SE, control, partitions);
+        if (partitions.size() < 2)
+        {
+            missed(L, "OnePartition", "istruzioni non separabili");
+            continue;
+        }
 
+        ORE.emit([&]()
+                 { return llvm::OptimizationRemark("loopdistribution", "Distributed", L->getStartLoc(), L->getHeader())
+                          << "loop distribuito in " << llvm::ore::NV("Partitions", unsigned(partitions.size())) << " loop"; });
+        distributeLoop(L, partitions, LI, DT, SE);
+        ++NumDistributed;
+        NumPartitions += partitions.size();
         modified = 1;
     }
 
-    if (modified)
-        return llvm::PreservedAnalyses::none();
-    else
+    if (!modified)
         return llvm::PreservedAnalyses::all();
-}
\ No newline at end of file
+
+    // LoopInfo registra le copie, DT viene ricalcolato dopo ogni distribuzione
+    llvm::PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    return PA;
+}
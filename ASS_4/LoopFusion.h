@@ -11,6 +11,12 @@ namespace llvm
     public:
         PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
     };
+
+    class LoopDistribution : public PassInfoMixin<LoopDistribution>
+    {
+    public:
+        PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+    };
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+//===-- PassPlugin.cpp - Registrazione dei passi come plugin --------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/Utils/LocalOpts.h"
+#include "llvm/Transforms/Utils/LoopFusion.h"
+#include "llvm/Transforms/Utils/LoopWalk.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+/**
+ * Rende i passi disponibili in -passes= con gli stessi nomi che avrebbero in PassRegistry.def,
+ * senza ricompilare opt. Esempi:
+ *   opt -load-pass-plugin=LLVMCompilersPasses.so -passes=localopts
+ *   opt -load-pass-plugin=LLVMCompilersPasses.so -passes='loop-simplify,loop-mssa(loopwalk)'
+ *   opt -load-pass-plugin=LLVMCompilersPasses.so -passes='loop-simplify,loopfusion'
+ */
+static void registerPasses(PassBuilder &PB)
+{
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>)
+        {
+            if (Name == "localopts")
+            {
+                MPM.addPass(LocalOpts());
+                return true;
+            }
+            return false;
+        });
+
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>)
+        {
+            if (Name == "loopfusion")
+            {
+                FPM.addPass(LoopFusion());
+                return true;
+            }
+            if (Name == "loopdistribution")
+            {
+                FPM.addPass(LoopDistribution());
+                return true;
+            }
+            return false;
+        });
+
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, LoopPassManager &LPM, ArrayRef<PassBuilder::PipelineElement>)
+        {
+            if (Name == "loopwalk")
+            {
+                LPM.addPass(LoopWalk());
+                return true;
+            }
+            if (Name == "loop-iv-sr")
+            {
+                LPM.addPass(LoopIVStrengthReduction());
+                return true;
+            }
+            if (Name == "loopwalk-unswitch")
+            {
+                LPM.addPass(LoopWalkUnswitch());
+                return true;
+            }
+            return false;
+        });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+    return {LLVM_PLUGIN_API_VERSION, "LLVMCompilersPasses", LLVM_VERSION_STRING, registerPasses};
+}
@@ -0,0 +1,516 @@
+#!/usr/bin/env python3
+"""
+Banco di prova per i passi degli Assignment, caricati in opt come plugin.
+
+Per ogni modulo del corpus e per ogni passo:
+  1. esegue il passo con -time-passes e ne estrae il tempo (mediana su --repeat esecuzioni),
+     riportato anche per istruzione del modulo;
+  2. chiude la pipeline con 'verify', così il modulo trasformato passa da verifyModule;
+  3. esegue con lli (JIT ORC di default, --jit-kind per cambiarlo) il modulo prima e dopo il passo
+     e confronta stdout e codice di uscita; i due tempi di esecuzione danno una stima del guadagno.
+
+Prima del corpus esegue i controlli di regressione in CHECKS (--no-checks per saltarli): piccoli
+moduli su cui un passo deve emettere, o non emettere, certe remark.
+
+Il corpus si genera (--generate 1,10,100: moduli con quel numero di kernel, ognuno con le forme
+che i passi cercano) oppure si legge da una cartella (--corpus dir: file .ll, .bc e, se c'è clang, .c).
+
+Esempio:
+  cmake -S . -B build -DLLVM_DIR=$(llvm-config --cmakedir) && cmake --build build
+  tools/harness.py --plugin build/LLVMCompilersPasses.so --generate 1,10,100
+"""
+
+import argparse
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# nome del passo -> (pipeline per opt, nome della classe come compare in -time-passes)
+PASSES = {
+    "localopts": ("localopts", "LocalOpts"),
+    "loopwalk": ("loop-simplify,lcssa,loop-mssa(loop-rotate,loopwalk)", "LoopWalk"),
+    "loop-iv-sr": ("loop-simplify,lcssa,loop(loop-iv-sr)", "LoopIVStrengthReduction"),
+    "loopwalk-unswitch": ("loop-simplify,lcssa,loop-mssa(loopwalk-unswitch)", "LoopWalkUnswitch"),
+    "loopfusion": ("loop-simplify,loopfusion", "LoopFusion"),
+    "loopdistribution": ("loop-simplify,loopdistribution", "LoopDistribution"),
+}
+
+TIMING_LINE = re.compile(r"^\s*(?:[0-9.]+ \(\s*[0-9.]+%\)\s+){3}([0-9.]+) \(\s*[0-9.]+%\)\s+(\S+)\s*$")
+
+
+def tool(args, name):
+    path = getattr(args, name.replace("-", "_"))
+    if not shutil.which(path):
+        sys.exit("harness: '%s' non trovato (usare --%s)" % (path, name))
+    return path
+
+
+def run(cmd, **kw):
+    return subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True, **kw)
+
+
+# ---------------------------------------------------------------------------------------------
+# Controlli di regressione
+# ---------------------------------------------------------------------------------------------
+
+# Loop di 3 blocchi sul target di default: la load invariante e "mul %c, 7" vanno spostate anche
+# con il modello di pressione sui registri attivo, perché il loop ha pochissimi valori vivi
+SMALL_LOOP = """
+@G = global i32 5
+
+define void @f(ptr noalias %a, i32 %n, i32 %c) {
+entry:
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %g = load i32, ptr @G
+  %m = mul i32 %c, 7
+  %s = add i32 %g, %m
+  %p = getelementptr inbounds i32, ptr %a, i32 %i
+  store i32 %s, ptr %p
+  br label %latch
+
+latch:
+  %i.next = add nsw i32 %i, 1
+  br label %header
+
+exit:
+  ret void
+}
+"""
+
+# Branch invariante in un loop con load e store su entrambi i lati: sotto loop-mssa(...) il loop
+# va duplicato comunque, aggiornando MemorySSA (verificata con -verify-memoryssa)
+UNSWITCH_LOOP = """
+@G = global i32 0
+
+define i32 @f(ptr noalias %a, i32 %n, i1 %c) {
+entry:
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %p = getelementptr inbounds i32, ptr %a, i32 %i
+  %v = load i32, ptr %p
+  br i1 %c, label %then, label %else
+
+then:
+  store i32 %v, ptr @G
+  br label %latch
+
+else:
+  %g = load i32, ptr @G
+  store i32 %g, ptr %p
+  br label %latch
+
+latch:
+  %i.next = add nsw i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %header, label %exit
+
+exit:
+  %r = load i32, ptr @G
+  ret i32 %r
+}
+"""
+
+# La condizione invariante è calcolata nel corpo del loop, da un argomento e da un flag globale
+# letto prima del loop: il passo da solo, senza loopwalk, deve copiarla davanti al test
+UNSWITCH_INNER_COND = """
+@Flag = global i32 0
+
+define i32 @f(ptr noalias %a, i32 %n, i32 %k) {
+entry:
+  %flag = load i32, ptr @Flag
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %latch ]
+  %p = getelementptr inbounds i32, ptr %a, i32 %i
+  %v = load i32, ptr %p
+  %kf = add i32 %k, %flag
+  %c = icmp sgt i32 %kf, 5
+  br i1 %c, label %then, label %else
+
+then:
+  %x = add i32 %v, 1
+  br label %latch
+
+else:
+  %y = mul i32 %v, 3
+  store i32 %y, ptr %p
+  br label %latch
+
+latch:
+  %z = phi i32 [ %x, %then ], [ %y, %else ]
+  %s.next = add i32 %s, %z
+  %i.next = add nsw i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %header, label %exit
+
+exit:
+  ret i32 %s.next
+}
+"""
+
+# i*4 è uno shift: sostituirlo con una ricorrenza aggiungerebbe solo un valore vivo in tutto il loop
+IV_POW2_MUL = """
+declare void @use(i32)
+
+define void @f(i32 %n) {
+entry:
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %header ]
+  %m = mul i32 %i, 4
+  call void @use(i32 %m)
+  %i.next = add nsw i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %header, label %exit
+
+exit:
+  ret void
+}
+"""
+
+# a[i] = a[i+1] + 1 accanto a una riduzione su b: a[i+1] passa per una catena di GEP più lunga di
+# quella che DependenceInfo esamina, che quindi non sa dire nulla della coppia. La distanza con SCEV
+# (1, in avanti) basta a separare la copia dalla riduzione
+DIST_CONFUSED_DI = """
+define i32 @f(ptr noalias %a, ptr noalias %b, i64 %n) {
+entry:
+  %g0 = getelementptr inbounds i8, ptr %a, i64 4
+  %g1 = getelementptr inbounds i8, ptr %g0, i64 0
+  %g2 = getelementptr inbounds i8, ptr %g1, i64 0
+  %g3 = getelementptr inbounds i8, ptr %g2, i64 0
+  %g4 = getelementptr inbounds i8, ptr %g3, i64 0
+  %g5 = getelementptr inbounds i8, ptr %g4, i64 0
+  %g6 = getelementptr inbounds i8, ptr %g5, i64 0
+  %g7 = getelementptr inbounds i8, ptr %g6, i64 0
+  %g8 = getelementptr inbounds i8, ptr %g7, i64 0
+  br label %header
+
+header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %header ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %header ]
+  %p = getelementptr inbounds i32, ptr %a, i64 %i
+  %q = getelementptr inbounds i32, ptr %g8, i64 %i
+  %v = load i32, ptr %q
+  %v1 = add i32 %v, 1
+  store i32 %v1, ptr %p
+  %bp = getelementptr inbounds i32, ptr %b, i64 %i
+  %w = load i32, ptr %bp
+  %s.next = add i32 %s, %w
+  %i.next = add nuw nsw i64 %i, 1
+  %cmp = icmp ult i64 %i.next, %n
+  br i1 %cmp, label %header, label %exit
+
+exit:
+  ret i32 %s.next
+}
+"""
+
+# (nome, passo, modulo, remark attese con il numero minimo di occorrenze, remark che non devono comparire)
+CHECKS = [
+    ("loopwalk-small-loop-hoists", "loopwalk", SMALL_LOOP, {"Hoisted": 3}, ["RegisterPressure"]),
+    ("loopwalk-unswitch-with-mssa", "loopwalk-unswitch", UNSWITCH_LOOP, {"Unswitched": 1}, ["NotUnswitched"]),
+    ("loop-iv-sr-keeps-pow2-mul", "loop-iv-sr", IV_POW2_MUL, {"IVNotProfitable": 1}, ["IVReduced"]),
+    ("loopdistribution-scev-distance", "loopdistribution", DIST_CONFUSED_DI, {"Distributed": 1}, []),
+    ("loopwalk-unswitch-inner-cond", "loopwalk-unswitch", UNSWITCH_INNER_COND, {"Unswitched": 1}, ["NotUnswitched"]),
+]
+
+
+def run_checks(args, workdir):
+    ok = True
+    for name, pass_name, module, expected, forbidden in CHECKS:
+        src = os.path.join(workdir, name + ".ll")
+        remarks = os.path.join(workdir, name + ".yaml")
+        with open(src, "w") as f:
+            f.write(module)
+        res = run([args.opt, "-load-pass-plugin=" + args.plugin, "-passes=%s,verify<domtree>,verify" % PASSES[pass_name][0],
+                   "-verify-memoryssa", "-pass-remarks-output=" + remarks, "-disable-output", src])
+        counts = {}
+        if res.returncode == 0:
+            with open(remarks) as f:
+                for remark in re.findall(r"^Name:\s+(\S+)", f.read(), re.M):
+                    counts[remark] = counts.get(remark, 0) + 1
+        failed = res.returncode != 0 or any(counts.get(r, 0) < n for r, n in expected.items()) or \
+            any(counts.get(r, 0) for r in forbidden)
+        ok &= not failed
+        print("check %-32s %s %s" % (name, "FAIL" if failed else "ok", counts if failed else ""))
+    return ok
+
+
+# ---------------------------------------------------------------------------------------------
+# Corpus generato
+# ---------------------------------------------------------------------------------------------
+
+KERNEL = """
+@A{k} = internal global [256 x i32] zeroinitializer
+@B{k} = internal global [256 x i32] zeroinitializer
+@C{k} = internal global i32 {c0}
+
+define internal i32 @kernel{k}(i32 %c, i1 %flag) {{
+entry:
+  br label %l1
+
+; moltiplicazioni e divisioni per costante, identità, codice invariante (mul %c e load di @C)
+l1:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %l1 ]
+  %inv.ld = load i32, ptr @C{k}
+  %inv = mul i32 %c, 7
+  %t0 = mul i32 %i, {m}
+  %t1 = add i32 %t0, %inv
+  %t2 = add i32 %t1, %inv.ld
+  %t3 = add i32 %t2, 0
+  %t4 = sdiv i32 %t3, {d}
+  %t5 = mul i32 %t4, 1
+  %pa1 = getelementptr inbounds [256 x i32], ptr @A{k}, i32 0, i32 %i
+  store i32 %t5, ptr %pa1
+  %i.next = add nsw i32 %i, 1
+  %ex1 = icmp slt i32 %i.next, 256
+  br i1 %ex1, label %l1, label %l2.pre
+
+; stesso numero di iterazioni del precedente (fusione) e un branch invariante (unswitch)
+l2.pre:
+  br label %l2
+
+l2:
+  %j = phi i32 [ 0, %l2.pre ], [ %j.next, %l2.latch ]
+  %pa2 = getelementptr inbounds [256 x i32], ptr @A{k}, i32 0, i32 %j
+  %va2 = load i32, ptr %pa2
+  br i1 %flag, label %l2.then, label %l2.else
+
+l2.then:
+  %x1 = mul i32 %va2, {m2}
+  br label %l2.latch
+
+l2.else:
+  %x2 = srem i32 %va2, {d2}
+  br label %l2.latch
+
+l2.latch:
+  %x = phi i32 [ %x1, %l2.then ], [ %x2, %l2.else ]
+  %pb2 = getelementptr inbounds [256 x i32], ptr @B{k}, i32 0, i32 %j
+  store i32 %x, ptr %pb2
+  %j.next = add nsw i32 %j, 1
+  %ex2 = icmp slt i32 %j.next, 256
+  br i1 %ex2, label %l2, label %l3.pre
+
+; una ricorrenza (la somma) e una parte indipendente (distribuzione)
+l3.pre:
+  br label %l3
+
+l3:
+  %h = phi i32 [ 0, %l3.pre ], [ %h.next, %l3 ]
+  %s = phi i32 [ 0, %l3.pre ], [ %s.next, %l3 ]
+  %pb3 = getelementptr inbounds [256 x i32], ptr @B{k}, i32 0, i32 %h
+  %vb3 = load i32, ptr %pb3
+  %s.next = add i32 %s, %vb3
+  %pa3 = getelementptr inbounds [256 x i32], ptr @A{k}, i32 0, i32 %h
+  %va3 = load i32, ptr %pa3
+  %y = shl i32 %va3, 1
+  store i32 %y, ptr %pa3
+  %h.next = add nsw i32 %h, 1
+  %ex3 = icmp slt i32 %h.next, 256
+  br i1 %ex3, label %l3, label %exit
+
+exit:
+  %s.lcssa = phi i32 [ %s.next, %l3 ]
+  %pa.last = getelementptr inbounds [256 x i32], ptr @A{k}, i32 0, i32 255
+  %a.last = load i32, ptr %pa.last
+  %r = xor i32 %s.lcssa, %a.last
+  ret i32 %r
+}}
+"""
+
+MAIN_HEAD = """
+@.fmt = private unnamed_addr constant [15 x i8] c"kernel %d: %d\\0A\\00"
+
+declare i32 @printf(ptr, ...)
+
+define i32 @main() {
+entry:
+"""
+
+MULS = [3, 5, 7, 10, 12, 15, 24, 31, 100, -3, -9, 1000]
+DIVS = [3, 5, 7, 10, 16, -4, 25, 1000]
+
+
+def generate_module(kernels):
+    parts = []
+    for k in range(kernels):
+        parts.append(KERNEL.format(k=k, c0=k * 13 - 50, m=MULS[k % len(MULS)], d=DIVS[k % len(DIVS)],
+                                   m2=MULS[(k + 5) % len(MULS)], d2=DIVS[(k + 3) % len(DIVS)]))
+    parts.append(MAIN_HEAD)
+    acc = "0"
+    for k in range(kernels):
+        parts.append("  %%r%d = call i32 @kernel%d(i32 %d, i1 %s)\n" % (k, k, k - 7, "true" if k % 2 else "false"))
+        parts.append("  call i32 (ptr, ...) @printf(ptr @.fmt, i32 %d, i32 %%r%d)\n" % (k, k))
+        parts.append("  %%acc%d = xor i32 %s, %%r%d\n" % (k, acc, k))
+        acc = "%%acc%d" % k
+    parts.append("  %%code = and i32 %s, 255\n  ret i32 %%code\n}\n" % acc)
+    return "".join(parts)
+
+
+def collect_corpus(args, workdir):
+    files = []
+    if args.generate:
+        for n in (int(x) for x in args.generate.split(",")):
+            path = os.path.join(workdir, "gen_%d.ll" % n)
+            with open(path, "w") as f:
+                f.write(generate_module(n))
+            files.append(path)
+    if args.corpus:
+        for name in sorted(os.listdir(args.corpus)):
+            src = os.path.join(args.corpus, name)
+            if name.endswith((".ll", ".bc")):
+                files.append(src)
+            elif name.endswith(".c"):
+                # stessa preparazione del README: -O0 senza optnone e poi mem2reg
+                if not shutil.which(args.clang):
+                    print("harness: salto %s, manca clang" % name, file=sys.stderr)
+                    continue
+                raw = os.path.join(workdir, name[:-2] + ".raw.ll")
+                out = os.path.join(workdir, name[:-2] + ".ll")
+                res = run([args.clang, "-O0", "-Xclang", "-disable-O0-optnone", "-S", "-emit-llvm", src, "-o", raw])
+                if res.returncode == 0:
+                    res = run([args.opt, "-passes=mem2reg", "-S", raw, "-o", out])
+                if res.returncode != 0:
+                    print("harness: salto %s\n%s" % (name, res.stderr), file=sys.stderr)
+                    continue
+                files.append(out)
+    return files
+
+
+# ---------------------------------------------------------------------------------------------
+# Misure
+# ---------------------------------------------------------------------------------------------
+
+def count_instructions(args, path):
+    # -stats c'è solo nelle build di LLVM con le asserzioni: si contano le righe del modulo testuale
+    res = run([args.opt, "-S", path])
+    return sum(1 for line in res.stdout.splitlines() if line.startswith("  ") and not line.lstrip().startswith(";"))
+
+
+def pass_time(stderr, class_name):
+    total = 0.0
+    for line in stderr.splitlines():
+        m = TIMING_LINE.match(line)
+        if m and m.group(2) == class_name:
+            total += float(m.group(1))
+    return total
+
+
+def execute(args, path):
+    cmd = [args.lli]
+    if args.jit_kind:
+        cmd.append("-jit-kind=" + args.jit_kind)
+    start = time.perf_counter()
+    res = run(cmd + [path], timeout=args.timeout)
+    return res.stdout, res.returncode, time.perf_counter() - start
+
+
+def measure(args, path, name, workdir):
+    pipeline, class_name = PASSES[name]
+    out = os.path.join(workdir, "%s.%s.ll" % (os.path.basename(path).rsplit(".", 1)[0], name))
+    base = [args.opt, "-load-pass-plugin=" + args.plugin, "-passes=%s,verify" % pipeline]
+
+    res = run(base + ["-S", path, "-o", out])
+    if res.returncode != 0:
+        errors = [line for line in res.stderr.splitlines() if "error" in line] or ["opt fallito"]
+        return {"verify": "FAIL", "error": errors[0].strip()}
+
+    times = []
+    for _ in range(args.repeat):
+        timed = run(base + ["-time-passes", "-disable-output", path])
+        times.append(pass_time(timed.stderr, class_name))
+    row = {"verify": "ok", "compile": statistics.median(times)}
+
+    if args.no_exec:
+        return row
+    before_out, before_code, _ = execute(args, path)
+    after_out, after_code, _ = execute(args, out)
+    row["diff"] = "ok" if (before_out, before_code) == (after_out, after_code) else "DIFF"
+    run_before = [execute(args, path)[2] for _ in range(args.repeat)]
+    run_after = [execute(args, out)[2] for _ in range(args.repeat)]
+    row["run_before"] = statistics.median(run_before)
+    row["run_after"] = statistics.median(run_after)
+    return row
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--plugin", default="build/LLVMCompilersPasses.so", help="plugin costruito con CMake")
+    ap.add_argument("--generate", help="dimensioni del corpus generato, in kernel per modulo (es. 1,10,100)")
+    ap.add_argument("--corpus", help="cartella con moduli .ll/.bc o sorgenti .c")
+    ap.add_argument("--passes", default=",".join(PASSES), help="passi da misurare (default: tutti)")
+    ap.add_argument("--repeat", type=int, default=5, help="esecuzioni per misura, si riporta la mediana")
+    ap.add_argument("--jit-kind", default="", help="motore di lli (orc, orc-lazy, mcjit); default quello di lli")
+    ap.add_argument("--no-exec", action="store_true", help="solo tempo di compilazione e verifyModule")
+    ap.add_argument("--no-checks", action="store_true", help="non eseguire i controlli di regressione")
+    ap.add_argument("--timeout", type=int, default=60, help="secondi massimi per un'esecuzione con lli")
+    ap.add_argument("--keep", help="cartella dove lasciare i moduli generati e trasformati")
+    ap.add_argument("--opt", default="opt")
+    ap.add_argument("--lli", default="lli")
+    ap.add_argument("--clang", default="clang")
+    args = ap.parse_args()
+
+    tool(args, "opt")
+    if not args.no_exec:
+        tool(args, "lli")
+    if not os.path.exists(args.plugin):
+        sys.exit("harness: plugin '%s' non trovato, compilarlo con CMake o passare --plugin" % args.plugin)
+    args.plugin = os.path.abspath(args.plugin)
+    names = args.passes.split(",")
+    for name in names:
+        if name not in PASSES:
+            sys.exit("harness: passo sconosciuto '%s' (disponibili: %s)" % (name, ", ".join(PASSES)))
+    if not args.generate and not args.corpus:
+        args.generate = "1,10,100"
+
+    workdir = args.keep or tempfile.mkdtemp(prefix="harness.")
+    os.makedirs(workdir, exist_ok=True)
+    failed = False
+    try:
+        if not args.no_checks:
+            failed = not run_checks(args, workdir)
+        print("%-24s %-18s %7s %11s %9s %6s %5s %10s %10s" %
+              ("modulo", "passo", "istr", "passo (ms)", "us/istr", "verify", "diff", "run prima", "run dopo"))
+        for path in collect_corpus(args, workdir):
+            instrs = count_instructions(args, path)
+            for name in names:
+                row = measure(args, path, name, workdir)
+                if "error" in row:
+                    failed = True
+                    print("%-24s %-18s %7d %11s %9s %6s   %s" % (os.path.basename(path), name, instrs, "-", "-",
+                                                              row["verify"], row["error"]))
+                    continue
+                ms = row["compile"] * 1000
+                per = ms * 1000 / instrs if instrs else 0
+                diff = row.get("diff", "-")
+                failed |= diff == "DIFF"
+                before = "%.3fs" % row["run_before"] if "run_before" in row else "-"
+                after = "%.3fs" % row["run_after"] if "run_after" in row else "-"
+                print("%-24s %-18s %7d %11.3f %9.3f %6s %5s %10s %10s" %
+                      (os.path.basename(path), name, instrs, ms, per, row["verify"], diff, before, after))
+    finally:
+        if not args.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())